@@ -0,0 +1,99 @@
+#include <Coalescer.hh>
+#include <Loopback.hh>
+#include <Probe.hh>
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+const size_t frame_size = 4096;
+const size_t recv_depth = 64;
+
+/// Sends count messages of msg_size bytes from side 0 to side 1 and returns messages per second
+double run(LoopbackPair &pair, size_t msg_size, uint64_t flush_ns, size_t count) {
+    CoalescerOptions opts;
+    opts.frame_size = frame_size;
+    opts.flush_bytes = frame_size;
+    opts.flush_ns = flush_ns;
+    Coalescer coalescer(pair.domain, pair.ep[0], pair.cq[0], opts);
+
+    RecvRing rx(pair, 1, frame_size, recv_depth, 1);
+
+    std::vector<char> payload(msg_size, 'x');
+    size_t sent = 0, received = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (received < count) {
+        if (sent < count) {
+            coalescer.send(pair.peer[0], payload.data(), msg_size).value();
+            if (++sent == count)
+                coalescer.flush().value();
+        }
+        if (sent % 64 == 0 || sent == count)
+            coalescer.progress().value();
+
+        rx.poll([&](const char *frame) {
+            if (!unpack_frame(frame, frame_size, [&](const char *, size_t) { received++; }))
+                throw FabricError(-FI_EIO, __FILE__, __LINE__);
+        });
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Let the last frames complete before the coalescer goes away
+    while (coalescer.in_flight())
+        coalescer.progress().value();
+    return count / elapsed.count();
+}
+
+int main(int argc, char **argv) {
+    ProbeOptions probe;
+    probe.ep_type = FI_EP_RDM;
+    const char *provider = nullptr;
+    size_t count = 200000;
+
+    int c;
+    while ((c = getopt(argc, argv, "p:t:n:")) != -1) {
+        switch (c) {
+            case 'p':
+                provider = optarg;
+                break;
+            case 't':
+                probe.ep_type = strcmp(optarg, "msg") ? FI_EP_RDM : FI_EP_MSG;
+                break;
+            case 'n':
+                count = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-p provider] [-t msg|rdm] [-n messages]" << std::endl;
+                return 1;
+        }
+    }
+
+    try {
+        FabricInfo info = provider_info(probe, provider);
+        LoopbackPair pair(info);
+        std::cout << "Provider: " << ProbeResult::describe(info) << std::endl;
+
+        std::cout << std::setw(8) << "size" << std::setw(14) << "flush (us)" << std::setw(16) << "msgs/s"
+                  << std::setw(12) << "MB/s" << std::endl;
+        for (size_t msg_size : {8, 16, 32, 64}) {
+            for (uint64_t flush_ns : {0, 1000, 10000, 100000}) {
+                double rate = run(pair, msg_size, flush_ns, count);
+                std::cout << std::setw(8) << msg_size << std::setw(14);
+                if (flush_ns)
+                    std::cout << flush_ns / 1000.0;
+                else
+                    std::cout << "off";
+                std::cout << std::setw(16) << std::fixed << std::setprecision(0) << rate
+                          << std::setw(12) << std::setprecision(1) << rate * msg_size / 1e6 << std::endl;
+            }
+        }
+    } catch (const FabricError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
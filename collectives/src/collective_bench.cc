@@ -0,0 +1,278 @@
+#include <Collectives.hh>
+#include <Probe.hh>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct BenchOptions {
+    const char *provider = nullptr;
+    size_t min_bytes = 8;
+    size_t max_bytes = 16 << 20;
+    size_t iterations = 1000;
+};
+
+/// Pipes between the launcher and one rank: up carries the rank's address, down the table of every rank's address
+struct RankPipes {
+    int up[2];
+    int down[2];
+};
+
+bool read_full(int fd, void *buf, size_t len) {
+    char *p = static_cast<char *>(buf);
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void *buf, size_t len) {
+    const char *p = static_cast<const char *>(buf);
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool write_name(int fd, const std::vector<char> &name) {
+    uint32_t len = name.size();
+    return write_full(fd, &len, sizeof(len)) && write_full(fd, name.data(), len);
+}
+
+bool read_name(int fd, std::vector<char> &name) {
+    uint32_t len;
+    if (!read_full(fd, &len, sizeof(len)))
+        return false;
+    name.resize(len);
+    return read_full(fd, name.data(), len);
+}
+
+/// Fewer iterations for big messages so every size takes roughly the same time
+size_t iterations_for(size_t bytes, size_t iterations) {
+    return std::clamp<size_t>((size_t(256) << 20) / std::max<size_t>(bytes, 1), 5, iterations);
+}
+
+int run_rank(int rank, int n, const BenchOptions &opts, int up, int down) {
+    ProbeOptions probe;
+    probe.caps = FI_TAGGED | FI_MSG;
+    probe.ep_type = FI_EP_RDM;
+    FabricInfo info = provider_info(probe, opts.provider);
+
+    Fabric fabric(info);
+    AccessDomain domain(fabric, info);
+    fi_cq_attr cq_attr = {};
+    cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+    cq_attr.wait_obj = FI_WAIT_NONE;
+    CompletionQueue cq(domain, &cq_attr);
+    fi_av_attr av_attr = {};
+    av_attr.type = info->domain_attr->av_type;
+    av_attr.count = n;
+    AddressVector av(domain, &av_attr);
+    ActiveEndpoint ep(domain, info);
+    ep.bind(av, 0);
+    ep.bind(cq, FI_TRANSMIT | FI_RECV);
+    ep.enable();
+
+    // Bootstrap through the launcher, AV order is rank order
+    if (!write_name(up, endpoint_name(&ep->fid)))
+        throw FabricError(-FI_EIO, __FILE__, __LINE__);
+    std::vector<fi_addr_t> peers(n);
+    std::vector<char> name;
+    for (int i = 0; i < n; i++) {
+        if (!read_name(down, name))
+            throw FabricError(-FI_EIO, __FILE__, __LINE__);
+        peers[i] = av.insert(name.data());
+    }
+
+    // One buffer for every size, declared before comm so the registrations cached for it never outlive it
+    std::vector<float> data(std::max<size_t>(opts.max_bytes / sizeof(float), 1));
+    CollectiveOptions coll_opts;
+    Communicator comm(domain, ep, cq, peers, rank, coll_opts);
+
+    // Average time per call over all ranks, in microseconds
+    auto timed = [&](size_t iters, auto &&op) {
+        comm.barrier().value();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iters; i++) {
+            op().value();
+        }
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        double us = elapsed.count() / iters;
+        comm.allreduce(&us, 1).value();
+        return us / n;
+    };
+    auto row = [&](const char *op, size_t bytes, double us, double bus_factor) {
+        if (rank != 0)
+            return;
+        std::cout << std::setw(6) << n << std::setw(16) << op << std::setw(12) << bytes << std::setw(14)
+                  << std::fixed << std::setprecision(2) << us;
+        if (bus_factor > 0)
+            std::cout << std::setw(14) << bytes / us / 1e3 * bus_factor;
+        std::cout << std::endl;
+    };
+
+    if (rank == 0)
+        std::cout << "Provider: " << ProbeResult::describe(info) << ", " << n << " ranks" << std::endl
+                  << std::setw(6) << "ranks" << std::setw(16) << "op" << std::setw(12) << "bytes" << std::setw(14)
+                  << "latency(us)" << std::setw(14) << "busbw(GB/s)" << std::endl;
+
+    row("barrier", 0, timed(opts.iterations, [&]() { return comm.barrier(); }), 0);
+
+    for (size_t bytes = opts.min_bytes; bytes <= opts.max_bytes; bytes *= 4) {
+        size_t count = std::max<size_t>(bytes / sizeof(float), 1);
+        bytes = count * sizeof(float);
+        size_t iters = iterations_for(bytes, opts.iterations);
+        std::fill_n(data.begin(), count, float(rank + 1));
+
+        // Small integers add up exactly in float, so every element must come back as 1 + 2 + ... + n
+        comm.allreduce(data.data(), count).value();
+        float expected = float(n) * (n + 1) / 2;
+        if (std::any_of(data.begin(), data.begin() + count, [&](float x) { return x != expected; })) {
+            std::cerr << "Rank " << rank << ": wrong allreduce result at " << bytes << " bytes" << std::endl;
+            return 1;
+        }
+
+        row("broadcast", bytes, timed(iters, [&]() { return comm.broadcast(data.data(), bytes, 0); }), 1);
+        bool ring = bytes >= coll_opts.ring_threshold && count >= size_t(n);
+        row(ring ? "allreduce/ring" : "allreduce/rd", bytes,
+            timed(iters, [&]() { return comm.allreduce(data.data(), count); }), 2.0 * (n - 1) / n);
+    }
+    return 0;
+}
+
+/// Forks n ranks, relays their addresses and waits for them. Returns non-zero if any rank failed.
+int launch(int n, const BenchOptions &opts) {
+    std::vector<RankPipes> pipes(n);
+    for (auto &p : pipes) {
+        if (pipe(p.up) || pipe(p.down)) {
+            perror("pipe");
+            return 1;
+        }
+    }
+
+    std::cout.flush();
+    std::vector<pid_t> pids;
+    for (int rank = 0; rank < n; rank++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            // Only keep this rank's ends, so the launcher sees EOF if a rank dies
+            for (int i = 0; i < n; i++) {
+                close(pipes[i].up[0]);
+                close(pipes[i].down[1]);
+                if (i != rank) {
+                    close(pipes[i].up[1]);
+                    close(pipes[i].down[0]);
+                }
+            }
+            int code;
+            try {
+                code = run_rank(rank, n, opts, pipes[rank].up[1], pipes[rank].down[0]);
+            } catch (const FabricError &e) {
+                std::cerr << "Rank " << rank << ": " << e.what() << std::endl;
+                code = 1;
+            }
+            std::cout.flush();
+            _exit(code);
+        }
+        pids.push_back(pid);
+    }
+
+    for (auto &p : pipes) {
+        close(p.up[1]);
+        close(p.down[0]);
+    }
+
+    // Collect every rank's address, then hand the whole table to each rank
+    std::vector<std::vector<char>> names(n);
+    bool ok = pids.size() == size_t(n);
+    for (int rank = 0; ok && rank < n; rank++) {
+        ok = read_name(pipes[rank].up[0], names[rank]);
+    }
+    for (int rank = 0; ok && rank < n; rank++) {
+        for (auto &name : names) {
+            ok = ok && write_name(pipes[rank].down[1], name);
+        }
+    }
+    for (auto &p : pipes) {
+        close(p.up[0]);
+        close(p.down[1]);
+    }
+
+    int failed = ok ? 0 : 1;
+    for (pid_t pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    }
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opts;
+    std::vector<int> ranks = {2, 4};
+
+    int c;
+    while ((c = getopt(argc, argv, "p:n:s:S:i:")) != -1) {
+        switch (c) {
+            case 'p':
+                opts.provider = optarg;
+                break;
+            case 'n': {
+                ranks.clear();
+                std::stringstream list(optarg);
+                std::string item;
+                while (std::getline(list, item, ','))
+                    ranks.push_back(std::stoi(item));
+                break;
+            }
+            case 's':
+                opts.min_bytes = std::stoul(optarg);
+                break;
+            case 'S':
+                opts.max_bytes = std::stoul(optarg);
+                break;
+            case 'i':
+                opts.iterations = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-p provider] [-n ranks,...] [-s min-bytes] [-S max-bytes] "
+                          << "[-i iterations]" << std::endl;
+                return 1;
+        }
+    }
+
+    // A rank dying mid-bootstrap should fail the run, not kill the launcher
+    signal(SIGPIPE, SIG_IGN);
+    for (int n : ranks) {
+        if (n < 1 || size_t(n) > Communicator::max_ranks) {
+            std::cerr << "Bad rank count " << n << std::endl;
+            return 1;
+        }
+        if (launch(n, opts)) {
+            std::cerr << "Run with " << n << " ranks failed" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -9,6 +9,8 @@
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #include <spdlog/spdlog.h>
 
+#include <FabricResult.hh>
+
 #include <cstring>
 #include <chrono>
 #include <thread>
@@ -34,12 +36,11 @@ char *remote_buf = new char[max_msg_size];
 char *local_buf = new char[max_msg_size];
 
 
-// Very nice way of error checking
+// Very nice way of error checking. Throws so main can clean up; -FI_EAGAIN on posts is handled by fabric_retry.
 #define safe_call(ans) callCheck((ans), __FILE__, __LINE__)
-inline int callCheck(int err, const char *file, int line, bool abort=true) {
+inline int callCheck(int err, const char *file, int line) {
     if (err < 0) {
-        std::cout << "Error: " << err << " " << fi_strerror(-err) << " " << file << ":" << line << std::endl;
-        exit(0);
+        throw FabricError(err, file, line);
     }
     return err;
 }
@@ -147,8 +148,9 @@ int run_server() {
     // Send data to client
     std::string data = "Hello, World!";
     memcpy(local_buf, data.c_str(), data.length());
-    safe_call(fi_send(ep, local_buf, data.length(), nullptr, 0, nullptr));
+    fabric_retry(tq, [&]() { return fi_send(ep, local_buf, data.length(), nullptr, 0, nullptr); }).value();
     safe_call(wait_for_completion(tq));
+    return 0;
 }
 
 int run_client() {
@@ -207,13 +209,14 @@ int run_client() {
     std::cout << "Connected" << std::endl;
 
     // Recieve a message from the server
-    safe_call(fi_recv(ep, remote_buf, max_msg_size, nullptr, 0, nullptr));
+    fabric_retry(rq, [&]() { return fi_recv(ep, remote_buf, max_msg_size, nullptr, 0, nullptr); }).value();
     safe_call(wait_for_completion(rq));
 
     std::cout << "Received: " << remote_buf << std::endl;
+    return 0;
 }
 
-int main(int argc, char **argv) {
+int run(int argc, char **argv) {
 
     hints = fi_allocinfo();
     hints->ep_attr->type = FI_EP_MSG;
@@ -237,8 +240,17 @@ int main(int argc, char **argv) {
     safe_call(fi_fabric(fi->fabric_attr, &fabric, nullptr));
 
     if (dest_addr) {
-        run_client();
+        return run_client();
     } else {
-    	run_server();
+    	return run_server();
+    }
+}
+
+int main(int argc, char **argv) {
+    try {
+        return run(argc, argv);
+    } catch (const FabricError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
     }
 }
\ No newline at end of file
@@ -9,6 +9,8 @@
 
 #include <iostream>
 
+#include <FabricResult.hh>
+
 // using namespace std;
 
 /* Wait for a new completion on the completion queue (from libfarbic_helloworld) */
@@ -32,11 +34,12 @@ int wait_for_completion(struct fid_cq *cq) {
 
 // This is pretty neat!
 // From here: https://stackoverflow.com/a/14038590
+// Only negative returns are errors; they throw so that main can report them. Posts that may see -FI_EAGAIN go
+// through fabric_retry instead.
 #define safe_call(ans) { callCheck((ans), __FILE__, __LINE__); }
-inline void callCheck(int err, const char *file, int line, bool abort=true) {
-	if (err != 0) {
-		std::cout << "Error: " << err << " " << fi_strerror(-err) << " " << file << ":" << line << std::endl;
-		exit(0);
+inline void callCheck(int err, const char *file, int line) {
+	if (err < 0) {
+		throw FabricError(err, file, line);
 	}
 }
 
@@ -49,7 +52,7 @@ char *local_buf;
 char *remote_buf;
 int max_msg_size = 4096;
 
-int main(int argc, char **argv) {
+int run(int argc, char **argv) {
 	// I don't release anything which isn't great, but eh whatever. 
 	fi_info *hints, *info;
 
@@ -140,7 +143,9 @@ int main(int argc, char **argv) {
 		memcpy(local_buf + sizeof(uint64_t) + addrlen + sizeof(Header), data.c_str(), data.length());
 
 		std::cout << "Sending " << data << " to server" << std::endl;
-		safe_call(fi_write(ep, local_buf, sizeof(uint64_t) + addrlen + data.length() + sizeof(Header), nullptr, remote_addr, 0, 0, nullptr));
+		fabric_retry(ctr, [&]() {
+			return fi_write(ep, local_buf, sizeof(uint64_t) + addrlen + data.length() + sizeof(Header), nullptr, remote_addr, 0, 0, nullptr);
+		}).value();
 		safe_call(fi_cntr_wait(ctr, 2, -1)); // Wait until the server responds. 
 		std::cout << "The server responded" << std::endl;
 		Header h = *(Header *) (remote_buf);
@@ -170,10 +175,22 @@ int main(int argc, char **argv) {
 		memcpy(local_buf + sizeof(Header), rec_data.c_str(), rec_data.length());
 		std::cout << "Responding to the client" << std::endl;
 		// std::cout << fi_cntr_read(ctr) << std::endl;
-		safe_call(fi_write(ep, local_buf, rec_data.length() + sizeof(Header), nullptr, remote_addr, 0, 0, nullptr));
+		fabric_retry(ctr, [&]() {
+			return fi_write(ep, local_buf, rec_data.length() + sizeof(Header), nullptr, remote_addr, 0, 0, nullptr);
+		}).value();
 		// std::cout << fi_cntr_read(ctr) << std::endl;
 		safe_call(fi_cntr_wait(ctr, 2, -1)); // Wait until the message is sent (the counter isn't incremented for the fi_write for some reason so this never completes. )
 		// std::cout << fi_cntr_readerr(ctr) << std::endl;
 		std::cout << "Response sent" << std::endl;
 	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	try {
+		return run(argc, argv);
+	} catch (const FabricError &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
 }
\ No newline at end of file
@@ -0,0 +1,589 @@
+#include <Fabric.hh>
+#include <Probe.hh>
+
+#include <rdma/fi_rma.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+const char *port = "8080";
+
+enum MessageType : uint32_t {
+    OPEN = 1,
+    READY,
+    GRANT,
+    WRITTEN,
+    DONE,
+};
+
+enum TransferMode : uint32_t {
+    MODE_RMA = 1,
+    MODE_BASELINE,
+};
+
+/// Client -> server: what is coming and where to put it
+struct OpenRequest {
+    uint32_t type;
+    uint32_t mode;
+    uint64_t size;
+    uint64_t chunk;
+    uint64_t depth;
+    uint64_t addrlen;
+    char addr[256];
+    char path[256];
+};
+
+/**
+ * Everything after the open request. Server -> client: READY, GRANT (RMA mode: window index of the destination is
+ * registered at addr/key) and DONE once the file is complete. Client -> server: WRITTEN (window index has landed).
+ */
+struct Control {
+    uint32_t type;
+    int32_t status;
+    uint64_t index;
+    uint64_t addr;
+    uint64_t key;
+};
+
+/// Every baseline chunk starts with the file offset it belongs at and the bytes that follow
+struct ChunkHeader {
+    uint64_t offset;
+    uint64_t len;
+};
+
+#define sys_call(ans) sysCheck((ans), #ans, __FILE__, __LINE__)
+inline long sysCheck(long ret, const char *what, const char *file, int line) {
+    if (ret < 0) {
+        std::cerr << what << ": " << strerror(errno) << " " << file << ":" << line << std::endl;
+        throw FabricError(-FI_EIO, file, line);
+    }
+    return ret;
+}
+
+/// read() until len bytes are in or the file ends, returns how many were read
+inline size_t read_full(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t n = sys_call(read(fd, buf + done, len - done));
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/// pwrite() all of len, a short write is not the end of it
+inline void pwrite_full(int fd, const char *buf, size_t len, uint64_t offset) {
+    while (len) {
+        size_t n = sys_call(pwrite(fd, buf, len, offset));
+        if (n == 0)
+            throw FabricError(-FI_EIO, __FILE__, __LINE__);
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+/// Whether a client supplied path stays below the server's directory: relative and without ".." components
+inline bool contained_path(const char *path) {
+    if (!*path || *path == '/')
+        return false;
+    for (const char *p = path; *p;) {
+        const char *end = strchrnul(p, '/');
+        if (end - p == 2 && p[0] == '.' && p[1] == '.')
+            return false;
+        p = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+/// Context of every posted operation. A completion only clears busy, so it is never lost whoever happens to poll.
+struct Op {
+    fi_context ctx;
+    bool busy = false;
+};
+
+/// Endpoint, CQ, AV and registered control slots, the same on both sides
+class Connection {
+public:
+    /// Control messages either side can have in flight
+    static constexpr size_t ctrl_slots = 64;
+    static constexpr size_t ctrl_size = 1024;
+    /// Windows in flight, each has a GRANT outstanding next to READY and DONE
+    static constexpr size_t max_depth = ctrl_slots - 2;
+
+    Connection(const char *node, uint64_t flags, const char *provider)
+            : ctrl(2 * ctrl_slots * ctrl_size), ctrl_rx(ctrl_slots), ctrl_tx(ctrl_slots) {
+        ProbeOptions opts;
+        opts.caps = FI_MSG | FI_RMA;
+        opts.ep_type = FI_EP_RDM;
+        info = provider_info(opts, provider, node, port, flags);
+        fabric = Fabric(info);
+        domain = AccessDomain(fabric, info);
+
+        fi_cq_attr cq_attr = {};
+        cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+        cq_attr.wait_obj = FI_WAIT_NONE;
+        cq = CompletionQueue(domain, &cq_attr);
+
+        fi_av_attr av_attr = {};
+        av_attr.type = info->domain_attr->av_type;
+        av_attr.count = 1;
+        av = AddressVector(domain, &av_attr);
+
+        ep = ActiveEndpoint(domain, info);
+        ep.bind(av, 0);
+        ep.bind(cq, FI_TRANSMIT | FI_RECV);
+        ep.enable();
+
+        ctrl_mr = MemoryRegion(domain, ctrl.data(), ctrl.size(), FI_SEND | FI_RECV, 0, 0, 0);
+        virt_addr = info->domain_attr->mr_mode == FI_MR_BASIC || (info->domain_attr->mr_mode & FI_MR_VIRT_ADDR);
+    }
+
+    // Control receives may still be posted, close the endpoint before their buffers go
+    ~Connection() {
+        ep.reset();
+    }
+
+    /// Polls the CQ once and marks whatever completed. Throws if an operation failed.
+    void progress() {
+        int failed = 0;
+        auto reaped = cq.reap([&](void *op_context, int err) {
+            if (op_context)
+                completion_owner<Op>(op_context)->busy = false;
+            if (err && !failed)
+                failed = err;
+        });
+        if (!reaped) [[unlikely]]
+            throw FabricError(reaped.error(), __FILE__, __LINE__);
+        if (failed) [[unlikely]]
+            throw FabricError(failed, __FILE__, __LINE__);
+    }
+
+    void wait(const Op &op) {
+        while (op.busy)
+            progress();
+    }
+
+    /// Sends a copy of msg without waiting for it; flush() before tearing down
+    template<typename T>
+    void send_ctrl(const T &msg) {
+        static_assert(sizeof(T) <= ctrl_size);
+        Op &op = ctrl_tx[next_tx];
+        wait(op);
+        char *slot = ctrl.data() + (ctrl_slots + next_tx) * ctrl_size;
+        memcpy(slot, &msg, sizeof(T));
+        fabric_retry_with([this]() { progress(); }, [&]() {
+            return fi_send(ep.get(), slot, sizeof(T), ctrl_mr.desc(), peer, &op.ctx);
+        }).value();
+        op.busy = true;
+        next_tx = (next_tx + 1) % ctrl_slots;
+    }
+
+    /// Waits until every control message sent so far has completed
+    void flush() {
+        for (auto &op : ctrl_tx) {
+            wait(op);
+        }
+    }
+
+    /**
+     * Control receives are posted ahead of time so the peer's message always has somewhere to land, one per message
+     * expected. They share the receive queue with baseline data, so only post them while no data can arrive.
+     */
+    void post_ctrl() {
+        if (rx_posted - rx_next == ctrl_slots) [[unlikely]]
+            throw FabricError(-FI_EINVAL, __FILE__, __LINE__);
+        Op &op = ctrl_rx[rx_posted % ctrl_slots];
+        char *slot = ctrl.data() + (rx_posted % ctrl_slots) * ctrl_size;
+        fabric_retry_with([this]() { progress(); }, [&]() {
+            return fi_recv(ep.get(), slot, ctrl_size, ctrl_mr.desc(), FI_ADDR_UNSPEC, &op.ctx);
+        }).value();
+        op.busy = true;
+        rx_posted++;
+    }
+
+    /// Takes the next control message if it has arrived. Receives match in the order they were posted.
+    template<typename T>
+    bool try_ctrl(T &msg) {
+        static_assert(sizeof(T) <= ctrl_size);
+        if (rx_next == rx_posted || ctrl_rx[rx_next % ctrl_slots].busy)
+            return false;
+        memcpy(&msg, ctrl.data() + (rx_next % ctrl_slots) * ctrl_size, sizeof(T));
+        rx_next++;
+        return true;
+    }
+
+    template<typename T>
+    T wait_ctrl() {
+        T msg;
+        while (!try_ctrl(msg))
+            progress();
+        return msg;
+    }
+
+    /// Where a registered local address shows up for the peer's RMA
+    uint64_t rma_addr(const void *base) const {
+        return virt_addr ? reinterpret_cast<uint64_t>(base) : 0;
+    }
+
+    FabricInfo info = FabricInfo(nullptr);
+    Fabric fabric;
+    AccessDomain domain;
+    CompletionQueue cq;
+    AddressVector av;
+    ActiveEndpoint ep;
+    fi_addr_t peer = FI_ADDR_UNSPEC;
+
+private:
+    /// ctrl_slots receive slots followed by ctrl_slots send slots
+    std::vector<char> ctrl;
+    MemoryRegion ctrl_mr;
+    std::vector<Op> ctrl_rx;
+    std::vector<Op> ctrl_tx;
+    uint64_t rx_posted = 0;
+    uint64_t rx_next = 0;
+    size_t next_tx = 0;
+    bool virt_addr;
+};
+
+/// A registered window of the source mapping on its way to the server
+struct Window {
+    Op op;
+    MemoryRegion mr;
+    uint64_t index = 0;
+    bool live = false;
+};
+
+/// Registered window of the destination mapping the client may write to
+struct Grant {
+    MemoryRegion mr;
+    uint64_t index = 0;
+};
+
+int run_server(const char *provider, const char *root) {
+    std::cout << "Initializing server" << std::endl;
+    int root_fd = sys_call(open(root, O_RDONLY | O_DIRECTORY));
+    Connection conn(nullptr, FI_SOURCE, provider);
+
+    conn.post_ctrl();
+    auto req = conn.wait_ctrl<OpenRequest>();
+    if (req.type != OPEN) {
+        std::cerr << "Expected an open request" << std::endl;
+        return 1;
+    }
+    conn.peer = conn.av.insert(req.addr);
+    req.path[sizeof(req.path) - 1] = 0;
+
+    Control reply = {READY, 0, 0, 0, 0};
+    if (!req.chunk || !req.depth || req.depth > Connection::max_depth || !contained_path(req.path)) {
+        reply.status = -FI_EINVAL;
+        conn.send_ctrl(reply);
+        conn.flush();
+        close(root_fd);
+        std::cerr << "Bad chunk size, depth or destination path" << std::endl;
+        return 1;
+    }
+    std::cout << "Receiving " << req.size << " bytes into " << root << "/" << req.path << std::endl;
+
+    // Destinations are created below the server's directory only, whatever path the client asks for
+    int fd = sys_call(openat(root_fd, req.path, O_RDWR | O_CREAT | O_TRUNC, 0644));
+    close(root_fd);
+    sys_call(ftruncate(fd, req.size));
+
+    if (req.mode == MODE_RMA) {
+        char *dest = nullptr;
+        if (req.size) {
+            void *map = mmap(nullptr, req.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED)
+                sys_call(-1);
+            dest = static_cast<char *>(map);
+        }
+
+        // Only depth windows of the mapping are registered at a time. Each one is granted to the client and
+        // deregistered once the client reports it written, which makes room for the next.
+        uint64_t windows = (req.size + req.chunk - 1) / req.chunk;
+        std::vector<Grant> grants(req.depth);
+        uint64_t granted = 0;
+        auto grant = [&](size_t slot) {
+            uint64_t offset = granted * req.chunk;
+            size_t len = std::min<uint64_t>(req.chunk, req.size - offset);
+            Grant &g = grants[slot];
+            g.mr = MemoryRegion(conn.domain, dest + offset, len, FI_REMOTE_WRITE, 0, slot + 1, 0);
+            g.index = granted++;
+            conn.send_ctrl(Control{GRANT, 0, g.index, conn.rma_addr(dest + offset), g.mr.key()});
+        };
+
+        for (size_t i = 0; i < req.depth; i++) {
+            conn.post_ctrl();
+        }
+        conn.send_ctrl(reply);
+        for (size_t slot = 0; slot < req.depth && granted < windows; slot++) {
+            grant(slot);
+        }
+        for (uint64_t written = 0; written < windows; written++) {
+            auto msg = conn.wait_ctrl<Control>();
+            conn.post_ctrl();
+            auto g = std::find_if(grants.begin(), grants.end(), [&](const Grant &candidate) {
+                return candidate.mr && candidate.index == msg.index;
+            });
+            if (msg.type != WRITTEN || g == grants.end()) {
+                std::cerr << "Expected a written window" << std::endl;
+                return 1;
+            }
+            g->mr.reset();
+            if (granted < windows)
+                grant(g - grants.begin());
+        }
+        if (dest)
+            munmap(dest, req.size);
+    } else {
+        size_t slot_size = sizeof(ChunkHeader) + req.chunk;
+        std::vector<char> buf(slot_size * req.depth);
+        MemoryRegion mr(conn.domain, buf.data(), buf.size(), FI_RECV, 0, 1, 0);
+        std::vector<Op> slots(req.depth);
+        // Every chunk but the last is full, so exactly this many receives are posted and none is left behind
+        uint64_t chunks = (req.size + req.chunk - 1) / req.chunk;
+        uint64_t posted = 0;
+        auto post = [&](size_t slot) {
+            fabric_retry_with([&]() { conn.progress(); }, [&]() {
+                return fi_recv(conn.ep.get(), buf.data() + slot * slot_size, slot_size, mr.desc(), FI_ADDR_UNSPEC,
+                               &slots[slot].ctx);
+            }).value();
+            slots[slot].busy = true;
+            posted++;
+        };
+        for (size_t i = 0; i < req.depth && posted < chunks; i++) {
+            post(i);
+        }
+        conn.send_ctrl(reply);
+
+        // Chunks land in the slots in the order they were posted
+        uint64_t received = 0;
+        for (uint64_t i = 0; i < chunks; i++) {
+            size_t slot = i % req.depth;
+            conn.wait(slots[slot]);
+            char *chunk = buf.data() + slot * slot_size;
+            ChunkHeader header;
+            memcpy(&header, chunk, sizeof(header));
+            if (header.len > req.chunk || header.offset > req.size || header.len > req.size - header.offset)
+                throw FabricError(-FI_EIO, __FILE__, __LINE__);
+            pwrite_full(fd, chunk + sizeof(header), header.len, header.offset);
+            received += header.len;
+            if (posted < chunks)
+                post(slot);
+        }
+        if (received != req.size) {
+            std::cerr << "Chunks do not add up to the file size" << std::endl;
+            return 1;
+        }
+    }
+    close(fd);
+
+    Control done = {DONE, 0, 0, 0, 0};
+    conn.send_ctrl(done);
+    conn.flush();
+    std::cout << "Wrote " << req.path << std::endl;
+    return 0;
+}
+
+int run_client(const char *provider, const char *server, const char *src, const char *dest_path, bool baseline,
+               size_t chunk, size_t depth) {
+    std::cout << "Initializing client" << std::endl;
+    Connection conn(server, 0, provider);
+    conn.peer = conn.av.insert(conn.info->dest_addr);
+
+    int fd = sys_call(open(src, O_RDONLY));
+    struct stat st;
+    sys_call(fstat(fd, &st));
+    uint64_t size = st.st_size;
+
+    OpenRequest req = {};
+    req.type = OPEN;
+    req.mode = baseline ? MODE_BASELINE : MODE_RMA;
+    req.size = size;
+    req.chunk = chunk;
+    req.depth = depth;
+    std::vector<char> name = endpoint_name(&conn.ep->fid);
+    if (name.size() > sizeof(req.addr) || strlen(dest_path) >= sizeof(req.path))
+        throw FabricError(-FI_EINVAL, __FILE__, __LINE__);
+    req.addrlen = name.size();
+    memcpy(req.addr, name.data(), name.size());
+    strcpy(req.path, dest_path);
+
+    // READY, the final DONE and a GRANT per window in flight
+    for (size_t i = 0; i < depth + 2; i++) {
+        conn.post_ctrl();
+    }
+    conn.send_ctrl(req);
+    auto ready = conn.wait_ctrl<Control>();
+    if (ready.type != READY || ready.status) {
+        std::cerr << "Server refused the transfer" << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (!baseline) {
+        char *map = nullptr;
+        if (size) {
+            void *m = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED)
+                sys_call(-1);
+            map = static_cast<char *>(m);
+            madvise(map, size, MADV_SEQUENTIAL);
+        }
+
+        // Without send-after-write ordering WRITTEN could overtake the data, so ask for delivery complete instead
+        bool ordered = conn.info->tx_attr->msg_order & FI_ORDER_SAW;
+        uint64_t flags = FI_COMPLETION | (ordered ? 0 : FI_DELIVERY_COMPLETE);
+
+        // Each GRANT gets a free window, the server never has more than depth of them outstanding
+        uint64_t total = (size + chunk - 1) / chunk;
+        std::vector<Window> windows(depth);
+        auto write = [&](const Control &grant) {
+            auto w = std::find_if(windows.begin(), windows.end(), [](const Window &w) { return !w.live; });
+            if (grant.type != GRANT || grant.index >= total || w == windows.end())
+                throw FabricError(-FI_EIO, __FILE__, __LINE__);
+
+            uint64_t offset = grant.index * chunk;
+            size_t len = std::min<uint64_t>(chunk, size - offset);
+            w->mr = MemoryRegion(conn.domain, map + offset, len, FI_WRITE, 0, w - windows.begin() + 1, 0);
+            w->index = grant.index;
+            w->live = true;
+
+            iovec iov = {map + offset, len};
+            void *desc = w->mr.desc();
+            fi_rma_iov rma_iov = {grant.addr, len, grant.key};
+            fi_msg_rma msg = {};
+            msg.msg_iov = &iov;
+            msg.desc = &desc;
+            msg.iov_count = 1;
+            msg.addr = conn.peer;
+            msg.rma_iov = &rma_iov;
+            msg.rma_iov_count = 1;
+            msg.context = &w->op.ctx;
+            fabric_retry_with([&]() { conn.progress(); }, [&]() {
+                return fi_writemsg(conn.ep.get(), &msg, flags);
+            }).value();
+            w->op.busy = true;
+        };
+
+        uint64_t written = 0;
+        while (written < total) {
+            conn.progress();
+            Control grant;
+            while (conn.try_ctrl(grant)) {
+                conn.post_ctrl();
+                write(grant);
+            }
+            for (auto &w : windows) {
+                if (w.live && !w.op.busy) {
+                    w.mr.reset();
+                    w.live = false;
+                    conn.send_ctrl(Control{WRITTEN, 0, w.index, 0, 0});
+                    written++;
+                }
+            }
+        }
+        if (map)
+            munmap(map, size);
+    } else {
+        size_t slot_size = sizeof(ChunkHeader) + chunk;
+        std::vector<char> buf(slot_size * depth);
+        MemoryRegion mr(conn.domain, buf.data(), buf.size(), FI_SEND, 0, 1, 0);
+        std::vector<Op> slots(depth);
+
+        uint64_t index = 0;
+        for (uint64_t offset = 0; offset < size; index++) {
+            size_t slot = index % depth;
+            conn.wait(slots[slot]);
+
+            char *chunk_buf = buf.data() + slot * slot_size;
+            size_t len = read_full(fd, chunk_buf + sizeof(ChunkHeader), chunk);
+            if (len == 0)
+                break;
+            ChunkHeader header = {offset, len};
+            memcpy(chunk_buf, &header, sizeof(header));
+            fabric_retry_with([&]() { conn.progress(); }, [&]() {
+                return fi_send(conn.ep.get(), chunk_buf, sizeof(header) + len, mr.desc(), conn.peer,
+                               &slots[slot].ctx);
+            }).value();
+            slots[slot].busy = true;
+            offset += len;
+        }
+        for (auto &op : slots) {
+            conn.wait(op);
+        }
+    }
+
+    auto done = conn.wait_ctrl<Control>();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    conn.flush();
+    close(fd);
+    if (done.type != DONE) {
+        std::cerr << "Expected done" << std::endl;
+        return 1;
+    }
+
+    std::cout << (baseline ? "read()+fi_send: " : "mmap+fi_write: ") << size << " bytes in " << elapsed.count()
+              << " s, " << size / elapsed.count() / 1e9 << " GB/s" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *provider = nullptr;
+    const char *root = ".";
+    bool baseline = false;
+    size_t chunk = 4 << 20;
+    size_t depth = 8;
+
+    int c;
+    while ((c = getopt(argc, argv, "bc:d:p:r:")) != -1) {
+        switch (c) {
+            case 'b':
+                baseline = true;
+                break;
+            case 'c':
+                chunk = std::stoul(optarg) << 20;
+                break;
+            case 'd':
+                depth = std::stoul(optarg);
+                break;
+            case 'p':
+                provider = optarg;
+                break;
+            case 'r':
+                root = optarg;
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-b] [-c chunk-MiB] [-d depth] [-p provider] [-r directory] "
+                          << "[<server-ip> <source-file> <destination-path>]" << std::endl;
+                return 1;
+        }
+    }
+
+    try {
+        if (optind == argc)
+            return run_server(provider, root);
+        if (argc - optind != 3 || !chunk || !depth) {
+            std::cerr << "Client needs <server-ip> <source-file> <destination-path>" << std::endl;
+            return 1;
+        }
+        if (depth > Connection::max_depth) {
+            std::cerr << "Depth is at most " << Connection::max_depth << std::endl;
+            return 1;
+        }
+        return run_client(provider, argv[optind], argv[optind + 1], argv[optind + 2], baseline, chunk, depth);
+    } catch (const FabricError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,133 @@
+#include <Loopback.hh>
+#include <MRCache.hh>
+#include <Probe.hh>
+
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+const size_t depth = 16;
+
+/// One outstanding send and whatever registration it is using
+struct Slot {
+    fi_context ctx;
+    MemoryRegion mr;
+    MRCache::Ref ref;
+    bool busy = false;
+};
+
+/// Sends count messages of msg_size bytes from random offsets in arena and returns messages per second
+double run(LoopbackPair &pair, std::vector<char> &arena, size_t msg_size, size_t count, MRCache *cache) {
+    std::vector<Slot> slots(depth);
+    RecvRing rx(pair, 1, msg_size, depth);
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<size_t> offset(0, arena.size() - msg_size);
+    uint64_t next_key = 1 << 20;
+
+    auto poll = [&]() {
+        int failed = 0;
+        pair.cq[0].reap([&](void *op_context, int err) {
+            if (op_context) {
+                Slot *slot = completion_owner<Slot>(op_context);
+                slot->mr.reset();
+                slot->ref.reset();
+                slot->busy = false;
+            }
+            if (err && !failed)
+                failed = err;
+        }).value();
+        if (failed) [[unlikely]]
+            throw FabricError(failed, __FILE__, __LINE__);
+        return rx.poll([](const char *) {});
+    };
+
+    size_t received = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        Slot &slot = slots[i % depth];
+        while (slot.busy)
+            received += poll();
+
+        const char *buf = arena.data() + offset(rng);
+        void *desc;
+        if (cache) {
+            slot.ref = cache->acquire(buf, msg_size);
+            desc = slot.ref.desc();
+        } else {
+            slot.mr = MemoryRegion(pair.domain, buf, msg_size, FI_SEND, 0, next_key++, 0);
+            desc = slot.mr.desc();
+        }
+        fabric_retry(pair.cq[0].get(), [&]() {
+            return fi_send(pair.ep[0].get(), buf, msg_size, desc, pair.peer[0], &slot.ctx);
+        }).value();
+        slot.busy = true;
+    }
+    while (received < count)
+        received += poll();
+    for (auto &slot : slots) {
+        while (slot.busy)
+            poll();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return count / elapsed.count();
+}
+
+int main(int argc, char **argv) {
+    const char *provider = nullptr;
+    size_t count = 20000;
+    size_t arena_mib = 64;
+    size_t max_pinned_mib = 256;
+
+    int c;
+    while ((c = getopt(argc, argv, "p:n:a:m:")) != -1) {
+        switch (c) {
+            case 'p':
+                provider = optarg;
+                break;
+            case 'n':
+                count = std::stoul(optarg);
+                break;
+            case 'a':
+                arena_mib = std::stoul(optarg);
+                break;
+            case 'm':
+                max_pinned_mib = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-p provider] [-n sends] [-a arena-MiB] [-m max-pinned-MiB]"
+                          << std::endl;
+                return 1;
+        }
+    }
+
+    try {
+        ProbeOptions probe;
+        probe.ep_type = FI_EP_RDM;
+        FabricInfo info = provider_info(probe, provider);
+        LoopbackPair pair(info);
+        std::cout << "Provider: " << ProbeResult::describe(info) << std::endl;
+
+        std::vector<char> arena(arena_mib << 20, 'x');
+        std::cout << std::setw(10) << "size" << std::setw(16) << "no cache" << std::setw(16) << "cache"
+                  << std::setw(10) << "hits" << std::setw(10) << "misses" << "   (msgs/s)" << std::endl;
+        for (size_t msg_size : {64, 4096, 65536, 1 << 20}) {
+            if (msg_size > info->ep_attr->max_msg_size || msg_size > arena.size())
+                break;
+            double without = run(pair, arena, msg_size, count, nullptr);
+
+            MRCache cache(DomainRegistrar(pair.domain, FI_SEND), max_pinned_mib << 20);
+            double with = run(pair, arena, msg_size, count, &cache);
+            std::cout << std::setw(10) << msg_size << std::setw(16) << std::fixed << std::setprecision(0) << without
+                      << std::setw(16) << with << std::setw(10) << cache.hits() << std::setw(10) << cache.misses()
+                      << std::endl;
+        }
+    } catch (const FabricError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <Probe.hh>
+
+#include <unistd.h>
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-c cache-file] [-s msg-size] [-n iterations] [-t msg|rdm|dgram] [-r] "
+              << "[msg|rma|tagged ...]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    ProbeOptions opts;
+    std::string cache_path = "fabric_probe.cache";
+    bool reprobe = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:s:n:t:rh")) != -1) {
+        switch (c) {
+            case 'c':
+                cache_path = optarg;
+                break;
+            case 's':
+                opts.msg_size = std::stoul(optarg);
+                break;
+            case 'n':
+                opts.iterations = std::stoi(optarg);
+                break;
+            case 't':
+                if (!strcmp(optarg, "msg")) {
+                    opts.ep_type = FI_EP_MSG;
+                } else if (!strcmp(optarg, "rdm")) {
+                    opts.ep_type = FI_EP_RDM;
+                } else if (!strcmp(optarg, "dgram")) {
+                    opts.ep_type = FI_EP_DGRAM;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                reprobe = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind < argc) {
+        opts.caps = 0;
+        for (int i = optind; i < argc; i++) {
+            if (!strcmp(argv[i], "msg")) {
+                opts.caps |= FI_MSG;
+            } else if (!strcmp(argv[i], "rma")) {
+                opts.caps |= FI_RMA;
+            } else if (!strcmp(argv[i], "tagged")) {
+                opts.caps |= FI_TAGGED;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    try {
+        if (!reprobe) {
+            FabricInfo cached = load_probe_cache(cache_path, opts);
+            if (cached) {
+                std::cout << "Cached choice in " << cache_path << " is still available: "
+                          << ProbeResult::describe(cached) << std::endl;
+                return 0;
+            }
+        }
+
+        std::cout << "Probing with " << opts.msg_size << " byte messages, " << opts.iterations << " iterations"
+                  << std::endl;
+        std::vector<ProbeResult> results = probe_providers(opts);
+        for (auto &r : results) {
+            std::cout << std::left << std::setw(60) << r.describe();
+            if (r.error) {
+                std::cout << "failed: " << fi_strerror(-r.error) << std::endl;
+                continue;
+            }
+            std::cout << std::fixed << std::setprecision(2) << r.latency_us << " us" << std::endl;
+        }
+
+        const ProbeResult *best = fastest(results);
+        if (!best) {
+            std::cerr << "No provider passed the probe" << std::endl;
+            return 1;
+        }
+
+        std::cout << "Selected " << best->describe() << std::endl;
+        if (!save_probe_cache(cache_path, opts, *best)) {
+            std::cerr << "Could not write " << cache_path << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << cache_path << std::endl;
+    } catch (const FabricError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
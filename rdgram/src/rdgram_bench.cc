@@ -0,0 +1,111 @@
+#include <Loopback.hh>
+#include <Probe.hh>
+#include <ReliableDatagram.hh>
+
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct RunResult {
+    double seconds;
+    ReliableStats stats;
+};
+
+/// Streams count messages of msg_size bytes from side 0 to side 1 of a fresh pair and waits until all are ACKed
+RunResult run(InfoView info, size_t msg_size, size_t count, double loss, size_t mtu) {
+    LoopbackPair pair(info);
+    ReliableOptions opts;
+    opts.loss = loss;
+    ReliableDatagram tx(opts, pair.domain, pair.ep[0], info, pair.cq[0], mtu);
+    ReliableDatagram rx(opts, pair.domain, pair.ep[1], info, pair.cq[1], mtu);
+    size_t to_rx = tx.add_peer(pair.peer[0]);
+    rx.add_peer(pair.peer[1]);
+
+    std::vector<char> msg(msg_size, 'x');
+    size_t sent = 0;
+    size_t received = 0;
+    auto deliver = [&](size_t, const char *, size_t len) {
+        if (len != msg_size)
+            throw FabricError(-FI_EOTHER, __FILE__, __LINE__);
+        received++;
+    };
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(60);
+    while (received < count || !tx.idle(to_rx)) {
+        while (sent < count && tx.send(to_rx, msg.data(), msg.size()))
+            sent++;
+        tx.progress([](size_t, const char *, size_t) {}).value();
+        rx.progress(deliver).value();
+        if (std::chrono::steady_clock::now() > deadline) [[unlikely]]
+            throw FabricError(-FI_ETIMEDOUT, __FILE__, __LINE__);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return {elapsed.count(), tx.stats()};
+}
+
+int main(int argc, char **argv) {
+    const char *provider = "udp";
+    size_t count = 20000;
+    size_t mtu = 1472;
+    std::vector<double> losses = {0, 1, 2, 5};
+
+    int c;
+    while ((c = getopt(argc, argv, "p:n:l:m:")) != -1) {
+        switch (c) {
+            case 'p':
+                provider = optarg;
+                break;
+            case 'n':
+                count = std::stoul(optarg);
+                break;
+            case 'l': {
+                losses.clear();
+                std::stringstream list(optarg);
+                std::string item;
+                while (std::getline(list, item, ','))
+                    losses.push_back(std::stod(item));
+                break;
+            }
+            case 'm':
+                mtu = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-p provider] [-n messages] [-l loss-percent,...] [-m mtu]"
+                          << std::endl;
+                return 1;
+        }
+    }
+
+    try {
+        ProbeOptions probe;
+        probe.caps = FI_MSG | FI_SOURCE;
+        probe.ep_type = FI_EP_DGRAM;
+        FabricInfo info = provider_info(probe, provider);
+        std::cout << "Provider: " << ProbeResult::describe(info) << ", mtu "
+                  << std::min(mtu, info->ep_attr->max_msg_size) << std::endl;
+
+        std::cout << std::setw(8) << "loss(%)" << std::setw(10) << "size" << std::setw(12) << "msgs/s"
+                  << std::setw(10) << "MB/s" << std::setw(10) << "packets" << std::setw(10) << "dropped"
+                  << std::setw(10) << "timeout" << std::setw(10) << "fast" << std::endl;
+        for (double loss : losses) {
+            for (size_t msg_size : {64, 1024, 8192, 65536}) {
+                RunResult r = run(info, msg_size, count, loss / 100, mtu);
+                std::cout << std::setw(8) << loss << std::setw(10) << msg_size << std::setw(12) << std::fixed
+                          << std::setprecision(0) << count / r.seconds << std::setw(10) << std::setprecision(1)
+                          << count * msg_size / r.seconds / 1e6 << std::setw(10) << r.stats.packets << std::setw(10)
+                          << r.stats.dropped << std::setw(10) << r.stats.retransmits << std::setw(10)
+                          << r.stats.fast_retransmits << std::endl;
+                std::cout.unsetf(std::ios::fixed);
+            }
+        }
+    } catch (const FabricError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
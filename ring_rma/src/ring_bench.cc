@@ -0,0 +1,98 @@
+#include <Loopback.hh>
+#include <Probe.hh>
+#include <RingChannel.hh>
+
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+int main(int argc, char **argv) {
+    const char *provider = nullptr;
+    size_t count = 1000000;
+    uint32_t slots = 1024;
+    uint32_t slot_size = 64;
+    uint32_t batch = 16;
+
+    int c;
+    while ((c = getopt(argc, argv, "p:n:s:z:b:")) != -1) {
+        switch (c) {
+            case 'p':
+                provider = optarg;
+                break;
+            case 'n':
+                count = std::stoul(optarg);
+                break;
+            case 's':
+                slots = std::stoul(optarg);
+                break;
+            case 'z':
+                slot_size = std::stoul(optarg);
+                break;
+            case 'b':
+                batch = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-p provider] [-n records] [-s slots] [-z slot-size] "
+                          << "[-b flush-batch]" << std::endl;
+                return 1;
+        }
+    }
+
+    try {
+        ProbeOptions probe;
+        probe.caps = FI_RMA;
+        probe.ep_type = FI_EP_RDM;
+        FabricInfo info = provider_info(probe, provider);
+        LoopbackPair pair(info);
+        std::cout << "Provider: " << ProbeResult::describe(info) << ", write-after-write ";
+        if (info->tx_attr->msg_order & FI_ORDER_WAW)
+            std::cout << "ordered up to " << info->ep_attr->max_order_waw_size << " bytes" << std::endl;
+        else
+            std::cout << "unordered" << std::endl;
+
+        RingConsumer consumer(pair.domain, pair.ep[1], info, pair.cq[1], slots, slot_size, 1);
+        RingProducer producer(pair.domain, pair.ep[0], info, pair.cq[0], slots, slot_size, 2, batch);
+        producer.connect(pair.peer[0], consumer.descriptor());
+        consumer.connect(pair.peer[1], producer.descriptor());
+
+        std::cout << std::setw(8) << "size" << std::setw(16) << "records/s" << std::setw(14) << "ns/record"
+                  << std::setw(12) << "MB/s" << std::endl;
+        std::vector<char> payload(producer.max_record(), 'x');
+        std::vector<uint32_t> sizes;
+        for (uint32_t size = 8; size < producer.max_record(); size *= 2) {
+            sizes.push_back(size);
+        }
+        sizes.push_back(producer.max_record());
+
+        for (uint32_t size : sizes) {
+            size_t pushed = 0, received = 0;
+            uint64_t checksum = 0;
+            auto start = std::chrono::steady_clock::now();
+            while (received < count) {
+                while (pushed < count && producer.try_push(payload.data(), size).value()) {
+                    pushed++;
+                }
+                producer.flush().value();
+                producer.progress().value();
+                received += consumer.poll([&](const char *data, uint32_t len) {
+                    checksum += len + data[0];
+                }).value();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (checksum != count * (size + 'x'))
+                throw FabricError(-FI_EIO, __FILE__, __LINE__);
+
+            double rate = count / elapsed.count();
+            std::cout << std::setw(8) << size << std::setw(16) << std::fixed << std::setprecision(0) << rate
+                      << std::setw(14) << std::setprecision(1) << 1e9 / rate
+                      << std::setw(12) << rate * size / 1e6 << std::endl;
+        }
+    } catch (const FabricError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
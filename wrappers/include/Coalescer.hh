@@ -0,0 +1,304 @@
+//
+// Opt-in coalescing of small messages. The sender packs messages for the same destination into one registered frame
+// and sends the frame when it is full enough, when its oldest message has waited long enough, or when asked to.
+// The receiver walks the frame with unpack_frame and gets each message back in the usual frame format (a
+// FrameHeader followed by the payload), so code that handled single messages keeps working on each record.
+//
+
+#include <Fabric.hh>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#ifndef NETWORKLAYER_COALESCER_HH
+#define NETWORKLAYER_COALESCER_HH
+
+/// Header of a single message, same layout as the Header in echo_rma
+struct FrameHeader {
+    uint16_t data_len;
+};
+
+/// Starts every coalesced frame, followed by count records of FrameHeader + payload
+struct BatchHeader {
+    uint16_t count;
+    /// Bytes of records after this header
+    uint16_t bytes;
+};
+
+/**
+ * Appends records to a caller owned buffer. Kept free of libfabric so the frame format can be tested on its own.
+ */
+class FramePacker {
+public:
+    FramePacker() = default;
+
+    FramePacker(char *buf, size_t capacity) : buf(buf), capacity(capacity) {
+        reset();
+    }
+
+    /// False if the record does not fit, in which case nothing is written
+    bool append(const void *data, size_t len) {
+        if (len > UINT16_MAX || sizeof(FrameHeader) + len > capacity - used) [[unlikely]]
+            return false;
+        size_t need = sizeof(FrameHeader) + len;
+        FrameHeader header = {static_cast<uint16_t>(len)};
+        memcpy(buf + used, &header, sizeof(header));
+        memcpy(buf + used + sizeof(header), data, len);
+        used += need;
+        count++;
+        BatchHeader batch = {count, static_cast<uint16_t>(used - sizeof(BatchHeader))};
+        memcpy(buf, &batch, sizeof(batch));
+        return true;
+    }
+
+    void reset() {
+        used = sizeof(BatchHeader);
+        count = 0;
+        BatchHeader batch = {0, 0};
+        memcpy(buf, &batch, sizeof(batch));
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    /// Bytes to send, batch header included
+    size_t size() const {
+        return used;
+    }
+
+    uint16_t records() const {
+        return count;
+    }
+
+    const char *data() const {
+        return buf;
+    }
+
+    /// Largest payload a single record can carry in a frame of this size
+    static size_t max_payload(size_t capacity) {
+        return capacity - sizeof(BatchHeader) - sizeof(FrameHeader);
+    }
+
+private:
+    char *buf = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    uint16_t count = 0;
+};
+
+/**
+ * Calls fn(record, record_len) for each message in a received frame, where record points at a FrameHeader followed
+ * by its payload. Returns false if the frame is malformed (truncated or inconsistent lengths).
+ */
+template<typename Fn>
+bool unpack_frame(const void *frame, size_t len, Fn &&fn) {
+    const char *p = static_cast<const char *>(frame);
+    if (len < sizeof(BatchHeader))
+        return false;
+    BatchHeader batch;
+    memcpy(&batch, p, sizeof(batch));
+    if (sizeof(BatchHeader) + batch.bytes > len)
+        return false;
+
+    const char *end = p + sizeof(BatchHeader) + batch.bytes;
+    p += sizeof(BatchHeader);
+    for (uint16_t i = 0; i < batch.count; i++) {
+        FrameHeader header;
+        if (p + sizeof(header) > end)
+            return false;
+        memcpy(&header, p, sizeof(header));
+        size_t record_len = sizeof(header) + header.data_len;
+        if (p + record_len > end)
+            return false;
+        fn(p, record_len);
+        p += record_len;
+    }
+    return p == end;
+}
+
+struct CoalescerOptions {
+    /// Size of each registered frame, at most 64 KiB because of the 16 bit batch header
+    size_t frame_size = 4096;
+    /// Send a frame once it holds this many bytes
+    size_t flush_bytes = 4096;
+    /// Send a frame once its oldest message is this old, checked in progress(). 0 sends every message straight
+    /// away, which is the uncoalesced baseline with the same framing.
+    uint64_t flush_ns = 10000;
+    /// Frames in the pool, i.e. how many can be filling or in flight at once
+    size_t frames = 64;
+};
+
+/**
+ * Send side. tx_cq must be the CQ the endpoint reports transmit completions to and must only see this coalescer's
+ * sends, since progress() reaps it to recycle frames.
+ */
+class Coalescer {
+public:
+    Coalescer(DomainView domain, EndpointView ep, CompletionQueue &tx_cq, CoalescerOptions opts = {})
+            : ep(ep), tx_cq(tx_cq), opts(opts), pool(opts.frame_size * opts.frames), frames(opts.frames) {
+        if (opts.frame_size > UINT16_MAX || opts.frame_size <= sizeof(BatchHeader) + sizeof(FrameHeader))
+            throw FabricError(-FI_EINVAL, __FILE__, __LINE__);
+        mr = MemoryRegion(domain, pool.data(), pool.size(), FI_SEND, 0, 0, 0);
+        desc = mr.desc();
+        free_frames.reserve(frames.size());
+        for (size_t i = 0; i < frames.size(); i++) {
+            frames[i].packer = FramePacker(pool.data() + i * opts.frame_size, opts.frame_size);
+            free_frames.push_back(&frames[i]);
+        }
+    }
+
+    Coalescer(const Coalescer &) = delete;
+
+    Coalescer &operator=(const Coalescer &) = delete;
+
+    /// Queues len bytes for dest. Returns -FI_EINVAL if the message can never fit in a frame.
+    FabricResult<void> send(fi_addr_t dest, const void *data, size_t len) {
+        if (len > FramePacker::max_payload(opts.frame_size)) [[unlikely]]
+            return FabricResult<void>::error(-FI_EINVAL);
+
+        Frame *frame = open_frame(dest);
+        if (!frame) [[unlikely]]
+            return FabricResult<void>::error(pending_error);
+        if (!frame->packer.append(data, len)) {
+            auto sent = post(frame);
+            if (!sent) [[unlikely]]
+                return sent;
+            frame = open_frame(dest);
+            if (!frame) [[unlikely]]
+                return FabricResult<void>::error(pending_error);
+            frame->packer.append(data, len);
+        }
+
+        if (frame->packer.size() >= opts.flush_bytes || opts.flush_ns == 0)
+            return post(frame);
+        return {};
+    }
+
+    /// Sends whatever is buffered for dest
+    FabricResult<void> flush(fi_addr_t dest) {
+        auto it = open.find(dest);
+        if (it == open.end())
+            return {};
+        return post(it->second);
+    }
+
+    /// Sends everything that is buffered
+    FabricResult<void> flush() {
+        while (!open.empty()) {
+            auto sent = post(open.begin()->second);
+            if (!sent) [[unlikely]]
+                return sent;
+        }
+        return {};
+    }
+
+    /// Recycles completed frames and sends the ones that have waited longer than flush_ns
+    FabricResult<void> progress() {
+        auto reaped = reap();
+        if (!reaped) [[unlikely]]
+            return reaped;
+        if (open.empty())
+            return {};
+
+        uint64_t now = now_ns();
+        for (auto it = open.begin(); it != open.end();) {
+            Frame *frame = it->second;
+            ++it; // post() erases the frame's entry
+            if (now - frame->first_ns >= opts.flush_ns) {
+                auto sent = post(frame);
+                if (!sent) [[unlikely]]
+                    return sent;
+            }
+        }
+        return {};
+    }
+
+    /// Frames sent but not completed yet
+    size_t in_flight() const {
+        return frames.size() - free_frames.size() - open.size();
+    }
+
+private:
+    struct Frame {
+        fi_context ctx;
+        FramePacker packer;
+        fi_addr_t dest;
+        uint64_t first_ns;
+    };
+
+    static uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    Frame *open_frame(fi_addr_t dest) {
+        auto it = open.find(dest);
+        if (it != open.end()) [[likely]]
+            return it->second;
+
+        while (free_frames.empty()) {
+            // Every frame is open for some other destination, nothing will come back unless one goes out
+            FabricResult<void> freed = in_flight() ? reap() : post(oldest_open());
+            if (!freed) [[unlikely]] {
+                pending_error = freed.error();
+                return nullptr;
+            }
+        }
+        Frame *frame = free_frames.back();
+        free_frames.pop_back();
+        frame->packer.reset();
+        frame->dest = dest;
+        frame->first_ns = now_ns();
+        open.emplace(dest, frame);
+        return frame;
+    }
+
+    Frame *oldest_open() const {
+        auto oldest = std::min_element(open.begin(), open.end(), [](const auto &a, const auto &b) {
+            return a.second->first_ns < b.second->first_ns;
+        });
+        return oldest->second;
+    }
+
+    FabricResult<void> post(Frame *frame) {
+        open.erase(frame->dest);
+        auto sent = fabric_retry_with([this]() { return reap(); }, [&]() {
+            return fi_send(ep.get(), frame->packer.data(), frame->packer.size(), desc, frame->dest, &frame->ctx);
+        });
+        if (!sent) [[unlikely]]
+            free_frames.push_back(frame);
+        return sent;
+    }
+
+    FabricResult<void> reap() {
+        int failed = 0;
+        auto reaped = tx_cq.reap([&](void *op_context, int err) {
+            if (op_context)
+                free_frames.push_back(completion_owner<Frame>(op_context));
+            if (err && !failed)
+                failed = err;
+        });
+        if (!reaped) [[unlikely]]
+            return FabricResult<void>::error(reaped.error());
+        if (failed) [[unlikely]]
+            return FabricResult<void>::error(failed);
+        return {};
+    }
+
+    EndpointView ep;
+    CompletionQueue &tx_cq;
+    CoalescerOptions opts;
+    std::vector<char> pool;
+    MemoryRegion mr;
+    void *desc = nullptr;
+    std::vector<Frame> frames;
+    std::vector<Frame *> free_frames;
+    std::unordered_map<fi_addr_t, Frame *> open;
+    int pending_error = 0;
+};
+
+#endif //NETWORKLAYER_COALESCER_HH
@@ -0,0 +1,413 @@
+//
+// Collectives over an RDM endpoint: binomial tree broadcast, dissemination barrier and sum allreduce. Allreduce uses
+// recursive doubling for small vectors, where latency dominates, and a ring reduce-scatter followed by a ring allgather
+// for large ones, where every rank sending and receiving 2 (N - 1) / N of the vector is what counts.
+//
+// Every rank has to call the same collectives in the same order. Messages are tagged with the collective's sequence
+// number, the step within it and the sending rank, so a message that shows up before its receive is posted (the
+// provider queues it as unexpected) still lands in the right place.
+//
+// Buffers passed in are registered through an MRCache, so repeating a collective on the same memory does not register
+// it again. Call invalidate() before freeing or unmapping such memory.
+//
+// An error leaves operations of the failed collective outstanding, the communicator cannot be used after one and
+// every later call returns that error.
+//
+
+#include <Fabric.hh>
+#include <MRCache.hh>
+
+#include <rdma/fi_tagged.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef NETWORKLAYER_COLLECTIVES_HH
+#define NETWORKLAYER_COLLECTIVES_HH
+
+/**
+ * dst[i] += src[i]. Works on 32 byte vectors with an unaligned load/store through memcpy, which the compiler turns
+ * into AVX with -mavx2 and into pairs of SSE or NEON ops otherwise, then finishes the tail one element at a time.
+ */
+template<typename T>
+inline void reduce_sum(T *dst, const T *src, size_t count) {
+    static_assert(std::is_same_v<T, float> || std::is_same_v<T, double> || std::is_same_v<T, int32_t>,
+                  "reduce_sum is only provided for float, double and int32_t");
+    size_t i = 0;
+#if defined(__GNUC__)
+    typedef T Vec __attribute__((vector_size(32)));
+    constexpr size_t lanes = sizeof(Vec) / sizeof(T);
+    for (; i + 2 * lanes <= count; i += 2 * lanes) {
+        Vec a0, a1, b0, b1;
+        memcpy(&a0, dst + i, sizeof(Vec));
+        memcpy(&a1, dst + i + lanes, sizeof(Vec));
+        memcpy(&b0, src + i, sizeof(Vec));
+        memcpy(&b1, src + i + lanes, sizeof(Vec));
+        a0 += b0;
+        a1 += b1;
+        memcpy(dst + i, &a0, sizeof(Vec));
+        memcpy(dst + i + lanes, &a1, sizeof(Vec));
+    }
+    for (; i + lanes <= count; i += lanes) {
+        Vec a, b;
+        memcpy(&a, dst + i, sizeof(Vec));
+        memcpy(&b, src + i, sizeof(Vec));
+        a += b;
+        memcpy(dst + i, &a, sizeof(Vec));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] += src[i];
+    }
+}
+
+/// Element offset and length of chunk i when count elements are split over n ranks, the first count % n get one more
+inline std::pair<size_t, size_t> ring_chunk(size_t count, int n, int i) {
+    size_t base = count / n;
+    size_t extra = count % n;
+    size_t index = i;
+    return {index * base + std::min(index, extra), base + (index < extra ? 1 : 0)};
+}
+
+/// Parent of vrank in a binomial tree rooted at 0 (clear the lowest set bit), -1 for the root
+inline int binomial_parent(int vrank) {
+    return vrank ? vrank & (vrank - 1) : -1;
+}
+
+/// Calls fn(child) for vrank's children in a binomial tree of n ranks rooted at 0, farthest subtree first
+template<typename Fn>
+void binomial_children(int vrank, int n, Fn &&fn) {
+    int limit = vrank ? vrank & -vrank : n;
+    int mask = 1;
+    while (mask < limit && mask < n)
+        mask <<= 1;
+    for (mask >>= 1; mask > 0; mask >>= 1) {
+        if (vrank + mask < n)
+            fn(vrank + mask);
+    }
+}
+
+enum class AllreduceAlgorithm {
+    automatic,
+    recursive_doubling,
+    ring
+};
+
+struct CollectiveOptions {
+    /// Allreduce of at least this many bytes uses the ring, smaller ones recursive doubling
+    size_t ring_threshold = 64 << 10;
+    /// Pinned bytes the registration cache may keep around
+    size_t max_pinned = size_t(1) << 30;
+};
+
+class Communicator {
+public:
+    static constexpr size_t max_ranks = 1 << 15;
+
+    /**
+     * peers[i] is how this endpoint addresses rank i, including itself at peers[rank]. ep needs FI_TAGGED and cq has
+     * to be bound to it for both directions and see nothing but this communicator's operations.
+     */
+    Communicator(DomainView domain, EndpointView ep, CompletionQueue &cq, std::vector<fi_addr_t> peers, int rank,
+                 CollectiveOptions opts = {})
+            : ep(ep), cq(cq), peers(std::move(peers)), me(rank), opts(opts),
+              cache(DomainRegistrar(domain, FI_SEND | FI_RECV), opts.max_pinned) {
+        if (rank < 0 || size_t(rank) >= this->peers.size() || this->peers.size() > max_ranks)
+            throw FabricError(-FI_EINVAL, __FILE__, __LINE__);
+    }
+
+    Communicator(const Communicator &) = delete;
+
+    Communicator &operator=(const Communicator &) = delete;
+
+    int rank() const {
+        return me;
+    }
+
+    int size() const {
+        return static_cast<int>(peers.size());
+    }
+
+    /// Returns once every rank has entered the barrier
+    FabricResult<void> barrier() {
+        seq++;
+        int n = size();
+        uint16_t step = 0;
+        for (int dist = 1; dist < n; dist <<= 1, step++) {
+            auto done = exchange((me + dist) % n, nullptr, 0, nullptr, (me - dist + n) % n, nullptr, 0, nullptr,
+                                 step);
+            if (!done) [[unlikely]]
+                return done;
+        }
+        return {};
+    }
+
+    /// Copies len bytes at buf on root to buf on every other rank. Throws FabricError if buf cannot be registered.
+    FabricResult<void> broadcast(void *buf, size_t len, int root) {
+        seq++;
+        int n = size();
+        if (n == 1)
+            return {};
+        MRCache::Ref ref = acquire(buf, len);
+        void *desc = ref ? ref.desc() : nullptr;
+
+        int vrank = (me - root + n) % n;
+        int parent = binomial_parent(vrank);
+        if (parent >= 0) {
+            auto received = post_recv((parent + root) % n, buf, len, desc, 0);
+            if (received)
+                received = wait_all();
+            if (!received) [[unlikely]]
+                return received;
+        }
+
+        FabricResult<void> sent;
+        binomial_children(vrank, n, [&](int child) {
+            if (sent)
+                sent = post_send((child + root) % n, buf, len, desc, 0);
+        });
+        if (!sent) [[unlikely]]
+            return sent;
+        return wait_all();
+    }
+
+    /**
+     * Sums count elements of data over all ranks, in place, and leaves the same bits on every rank. Throws
+     * FabricError if data or the scratch space cannot be registered.
+     */
+    template<typename T>
+    FabricResult<void> allreduce(T *data, size_t count, AllreduceAlgorithm algorithm = AllreduceAlgorithm::automatic) {
+        seq++;
+        if (size() == 1 || count == 0)
+            return {};
+        if (algorithm == AllreduceAlgorithm::automatic)
+            algorithm = count * sizeof(T) >= opts.ring_threshold && count >= size_t(size())
+                        ? AllreduceAlgorithm::ring : AllreduceAlgorithm::recursive_doubling;
+
+        MRCache::Ref ref = acquire(data, count * sizeof(T));
+        if (algorithm == AllreduceAlgorithm::ring)
+            return allreduce_ring(data, count, ref.desc());
+        return allreduce_recursive_doubling(data, count, ref.desc());
+    }
+
+    /// Forgets registrations covering [buf, buf + len), call before giving that memory back to the system
+    void invalidate(const void *buf, size_t len) {
+        cache.invalidate(buf, len);
+    }
+
+private:
+    static constexpr size_t max_ops = 64;
+
+    /// Tag of a message sent by from: 32 bit collective sequence number, 16 bit step, 16 bit sending rank
+    uint64_t tag(uint16_t step, int from) const {
+        return (uint64_t(seq) << 32) | (uint64_t(step) << 16) | uint16_t(from);
+    }
+
+    MRCache::Ref acquire(const void *buf, size_t len) {
+        return len ? cache.acquire(buf, len) : MRCache::Ref();
+    }
+
+    /// Scratch space for at least len bytes. Growing drops the old buffer's registration before freeing it.
+    char *scratch_buffer(size_t len) {
+        if (scratch.size() < len) {
+            if (!scratch.empty())
+                cache.invalidate(scratch.data(), scratch.size());
+            scratch = std::vector<char>(len);
+        }
+        return scratch.data();
+    }
+
+    template<typename T>
+    FabricResult<void> allreduce_recursive_doubling(T *data, size_t count, void *desc) {
+        const uint16_t fold = 0, unfold = 1, first_round = 2;
+        size_t bytes = count * sizeof(T);
+        T *tmp = reinterpret_cast<T *>(scratch_buffer(bytes));
+        MRCache::Ref tmp_ref = acquire(tmp, bytes);
+
+        // Ranks past the largest power of two fold into a neighbour first: even ranks below 2 * extra hand their
+        // vector to rank + 1, sit out the doubling and get the result back at the end
+        int n = size();
+        int pof2 = 1;
+        while (pof2 * 2 <= n)
+            pof2 *= 2;
+        int extra = n - pof2;
+
+        FabricResult<void> done;
+        int vrank;
+        if (me < 2 * extra) {
+            if (me % 2 == 0) {
+                done = exchange(me + 1, data, bytes, desc, -1, nullptr, 0, nullptr, fold);
+                vrank = -1;
+            } else {
+                done = exchange(-1, nullptr, 0, nullptr, me - 1, tmp, bytes, tmp_ref.desc(), fold);
+                vrank = me / 2;
+            }
+            if (!done) [[unlikely]]
+                return done;
+            if (vrank >= 0)
+                reduce_sum(data, tmp, count);
+        } else {
+            vrank = me - extra;
+        }
+
+        if (vrank >= 0) {
+            uint16_t step = first_round;
+            for (int mask = 1; mask < pof2; mask <<= 1, step++) {
+                int vpeer = vrank ^ mask;
+                int peer = vpeer < extra ? vpeer * 2 + 1 : vpeer + extra;
+                done = exchange(peer, data, bytes, desc, peer, tmp, bytes, tmp_ref.desc(), step);
+                if (!done) [[unlikely]]
+                    return done;
+                reduce_sum(data, tmp, count);
+            }
+        }
+
+        if (me < 2 * extra) {
+            if (me % 2 == 0)
+                return exchange(-1, nullptr, 0, nullptr, me + 1, data, bytes, desc, unfold);
+            return exchange(me - 1, data, bytes, desc, -1, nullptr, 0, nullptr, unfold);
+        }
+        return {};
+    }
+
+    template<typename T>
+    FabricResult<void> allreduce_ring(T *data, size_t count, void *desc) {
+        int n = size();
+        int right = (me + 1) % n;
+        int left = (me - 1 + n) % n;
+        size_t max_chunk = ring_chunk(count, n, 0).second * sizeof(T);
+        T *tmp = reinterpret_cast<T *>(scratch_buffer(max_chunk));
+        MRCache::Ref tmp_ref = acquire(tmp, max_chunk);
+        uint16_t step = 0;
+
+        // Reduce-scatter: after n - 1 steps chunk (me + 1) % n holds the full sum
+        for (int s = 0; s < n - 1; s++, step++) {
+            auto [send_off, send_len] = ring_chunk(count, n, (me - s + n) % n);
+            auto [recv_off, recv_len] = ring_chunk(count, n, (me - s - 1 + 2 * n) % n);
+            auto done = exchange(right, data + send_off, send_len * sizeof(T), desc, left, tmp, recv_len * sizeof(T),
+                                 tmp_ref.desc(), step);
+            if (!done) [[unlikely]]
+                return done;
+            reduce_sum(data + recv_off, tmp, recv_len);
+        }
+
+        // Allgather: pass the finished chunks around, straight into place
+        for (int s = 0; s < n - 1; s++, step++) {
+            auto [send_off, send_len] = ring_chunk(count, n, (me + 1 - s + n) % n);
+            auto [recv_off, recv_len] = ring_chunk(count, n, (me - s + n) % n);
+            auto done = exchange(right, data + send_off, send_len * sizeof(T), desc, left, data + recv_off,
+                                 recv_len * sizeof(T), desc, step);
+            if (!done) [[unlikely]]
+                return done;
+        }
+        return {};
+    }
+
+    /// Posts a receive from `from` and a send to `to` (either skipped if -1) and waits for both
+    FabricResult<void> exchange(int to, const void *send_buf, size_t send_len, void *send_desc, int from,
+                                void *recv_buf, size_t recv_len, void *recv_desc, uint16_t step) {
+        FabricResult<void> posted;
+        if (from >= 0)
+            posted = post_recv(from, recv_buf, recv_len, recv_desc, step);
+        if (posted && to >= 0)
+            posted = post_send(to, send_buf, send_len, send_desc, step);
+        if (!posted) [[unlikely]]
+            return posted;
+        return wait_all();
+    }
+
+    FabricResult<void> post_send(int to, const void *buf, size_t len, void *desc, uint16_t step) {
+        uint64_t t = tag(step, me);
+        auto context = next_context();
+        if (!context) [[unlikely]]
+            return FabricResult<void>::error(context.error());
+        auto posted = fabric_retry_with([this]() { return reap(); }, [&]() {
+            return fi_tsend(ep.get(), buf, len, desc, peers[to], t, &(*context)->ctx);
+        });
+        if (posted) [[likely]]
+            started(*context);
+        return posted;
+    }
+
+    FabricResult<void> post_recv(int from, void *buf, size_t len, void *desc, uint16_t step) {
+        uint64_t t = tag(step, from);
+        auto context = next_context();
+        if (!context) [[unlikely]]
+            return FabricResult<void>::error(context.error());
+        auto posted = fabric_retry_with([this]() { return reap(); }, [&]() {
+            return fi_trecv(ep.get(), buf, len, desc, peers[from], t, 0, &(*context)->ctx);
+        });
+        if (posted) [[likely]]
+            started(*context);
+        return posted;
+    }
+
+    struct OpContext {
+        fi_context ctx;
+        bool busy;
+    };
+
+    /// The next context in turn, once whatever used it last has completed. Operations complete in any order.
+    FabricResult<OpContext *> next_context() {
+        OpContext *context = &contexts[next];
+        while (context->busy) {
+            auto reaped = reap();
+            if (!reaped) [[unlikely]]
+                return FabricResult<OpContext *>::error(reaped.error());
+        }
+        next = (next + 1) % max_ops;
+        return context;
+    }
+
+    void started(OpContext *context) {
+        context->busy = true;
+        outstanding++;
+    }
+
+    /// Gives the first failed operation's error from then on, the data of that collective is wrong
+    FabricResult<void> reap() {
+        auto reaped = cq.reap([&](void *op_context, int err) {
+            if (op_context) {
+                completion_owner<OpContext>(op_context)->busy = false;
+                outstanding--;
+            }
+            if (err && !op_error)
+                op_error = err;
+        });
+        if (!reaped) [[unlikely]]
+            return FabricResult<void>::error(reaped.error());
+        if (op_error) [[unlikely]]
+            return FabricResult<void>::error(op_error);
+        return {};
+    }
+
+    FabricResult<void> wait_all() {
+        while (outstanding) {
+            auto reaped = reap();
+            if (!reaped) [[unlikely]]
+                return reaped;
+        }
+        if (op_error) [[unlikely]]
+            return FabricResult<void>::error(op_error);
+        return {};
+    }
+
+    EndpointView ep;
+    CompletionQueue &cq;
+    std::vector<fi_addr_t> peers;
+    int me;
+    CollectiveOptions opts;
+    MRCache cache;
+    std::vector<char> scratch;
+    uint32_t seq = 0;
+    OpContext contexts[max_ops] = {};
+    size_t next = 0;
+    size_t outstanding = 0;
+    int op_error = 0;
+};
+
+#endif //NETWORKLAYER_COLLECTIVES_HH
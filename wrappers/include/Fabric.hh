@@ -5,366 +5,371 @@
 #include <rdma/fabric.h>
 #include <rdma/fi_domain.h>
 #include <rdma/fi_endpoint.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_cm.h>
 
-#include <cstdio>
-#include <cstdlib>
+#include <FabricResult.hh>
+
+#include <cstddef>
 #include <iostream>
-#include <atomic>
-#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #ifndef NETWORKLAYER_FABRICCXX_HH
 #define NETWORKLAYER_FABRICCXX_HH
 
 #define ERRCHK(x) error_check((x), __FILE__, __LINE__);
 
-inline void error_check(int err, std::string file, int line) {
-    if (err) {
-        std::cerr << "ERROR (" << err << "): " << fi_strerror(-err) << std::endl;
-        std::cerr << file << ":" << line << std::endl;
-
-        exit(1);
+/// Setup calls: a non-zero return throws FabricError. Hot paths return FabricResult instead (see FabricResult.hh).
+inline void error_check(int err, const char *file, int line) {
+    if (err) [[unlikely]] {
+        throw FabricError(err < 0 ? err : -FI_EOTHER, file, line);
     }
 }
 
 const int FIVersion = FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION);
 
-class FabricInfo {
-public:
-    FabricInfo() : ref(new std::atomic_uint(1)) {
-        info = fi_allocinfo();
+/**
+ * How a handle gives its object back to libfabric. Everything except fi_info is a fid and is closed with fi_close.
+ */
+template<typename T>
+struct HandleTraits {
+    static int close(T *obj) {
+        return fi_close(&obj->fid);
     }
+};
 
-    FabricInfo(uint32_t version, const char *node, const char *service, uint64_t flags,
-               FabricInfo &hints) : ref(new std::atomic_uint(1)) {
-        ERRCHK(fi_getinfo(version, node, service, flags, hints.get(), &info));
+template<>
+struct HandleTraits<fi_info> {
+    static int close(fi_info *obj) {
+        fi_freeinfo(obj);
+        return 0;
     }
+};
+
+/**
+ * Move-only owner of a libfabric object. There is no reference count: the owner is the only thing that closes the
+ * object, and moving it just transfers the pointer. Children (domains, endpoints, ...) are created from a View of
+ * their parent and do not keep it alive, so the parent has to outlive them, which declaration order normally gives
+ * you. If something really has to be shared, put the owner in a std::make_shared, which is one allocation.
+ * Default constructed wrappers are empty, to be move-assigned later.
+ */
+template<typename T>
+class Handle {
+public:
+    Handle() noexcept: obj(nullptr) {}
+
+    explicit Handle(T *obj) noexcept: obj(obj) {}
+
+    Handle(const Handle &) = delete;
 
-    FabricInfo(const FabricInfo &other) {
-        other.ref->operator++();
-        info = other.info;
-        ref = other.ref;
+    Handle &operator=(const Handle &) = delete;
+
+    Handle(Handle &&other) noexcept: obj(std::exchange(other.obj, nullptr)) {}
+
+    Handle &operator=(Handle &&other) noexcept {
+        if (&other != this) {
+            reset();
+            obj = std::exchange(other.obj, nullptr);
+        }
+        return *this;
     }
 
-    FabricInfo(FabricInfo &&other) {
-        info = other.info;
-        ref = other.ref;
-        other.ref = nullptr;
-        other.info = nullptr;
+    ~Handle() {
+        reset();
     }
 
-    ~FabricInfo() {
-        if (info && ref->operator--() == 0) {
-            fi_freeinfo(info);
-            delete ref;
+    void reset() noexcept {
+        if (obj) {
+            int err = HandleTraits<T>::close(obj);
+            if (err) {
+                std::cerr << "ERROR (" << err << ") closing handle: " << fi_strerror(-err) << std::endl;
+            }
+            obj = nullptr;
         }
     }
 
-    FabricInfo& operator=(const FabricInfo &other) {
-        if(&other == this)
-            return *this;
-        other.ref->operator++();
-        info = other.info;
-        ref = other.ref;
-        return *this;
+    T *release() noexcept {
+        return std::exchange(obj, nullptr);
     }
 
-    FabricInfo& operator=(FabricInfo &&other) noexcept {
-        if(&other == this)
-            return *this;
-        info = other.info;
-        ref = other.ref;
-        other.ref = nullptr;
-        other.info = nullptr;
-        return *this;
+    T *operator->() const noexcept {
+        return obj;
     }
 
-
-    fi_info *operator->() const {
-        return info;
+    T *get() const noexcept {
+        return obj;
     }
 
-    fi_info *get() const {
-        return info;
+    explicit operator bool() const noexcept {
+        return obj != nullptr;
     }
 
-private:
-    fi_info *info;
-    std::atomic_uint *ref;
+protected:
+    T *obj;
 };
 
-class Fabric {
+/**
+ * Non-owning view of a libfabric object. It is a plain pointer, so copying it costs nothing.
+ */
+template<typename T>
+class View {
 public:
-    Fabric(FabricInfo &info) : info_(info), ref(new std::atomic_uint(1)) {
-        ERRCHK(fi_fabric(info->fabric_attr, &fabric, nullptr));
-    }
+    View(T *obj) noexcept: obj(obj) {}
 
-    Fabric(const Fabric &other) {
-        other.ref->operator++();
-        ref = other.ref;
-        fabric = other.fabric;
-        info_ = other.info_;
-    }
+    View(const Handle<T> &owner) noexcept: obj(owner.get()) {}
 
-    Fabric(Fabric &&other) {
-        fabric = other.fabric;
-        ref = other.ref;
-        other.ref = nullptr;
-        other.fabric = nullptr;
-        info_ = std::move(other.info_);
-    }
-
-    ~Fabric() {
-        if (fabric && ref->operator--() == 0) {
-            ERRCHK(fi_close(&fabric->fid));
-            delete ref;
-        }
+    T *operator->() const noexcept {
+        return obj;
     }
 
-    fid_fabric *operator->() const {
-        return fabric;
+    T *get() const noexcept {
+        return obj;
     }
 
-    fid_fabric *get() const {
-        return fabric;
+    explicit operator bool() const noexcept {
+        return obj != nullptr;
     }
 
 private:
-    fid_fabric *fabric;
-    std::atomic_uint *ref;
-    FabricInfo info_;
+    T *obj;
 };
 
-class EventQueue {
-public:
-    EventQueue(Fabric &fabric, fi_eq_attr *attr) : fabric_(fabric) {
-        if (fi_eq_open(fabric.get(), attr, &eq, nullptr)) {
-            perror("Opening event queue:");
-        }
-    }
+/// Address of an endpoint (active or passive) as raw bytes, ready for fi_av_insert, fi_connect or to be sent to a peer
+inline std::vector<char> endpoint_name(fid *f) {
+    size_t len = 0;
+    fi_getname(f, nullptr, &len); // -FI_ETOOSMALL, but fills in len
+    std::vector<char> name(len);
+    ERRCHK(fi_getname(f, name.data(), &len));
+    name.resize(len);
+    return name;
+}
 
-    EventQueue(const EventQueue &) = delete;
+using InfoView = View<fi_info>;
+using FabricView = View<fid_fabric>;
+using DomainView = View<fid_domain>;
+using EndpointView = View<fid_ep>;
 
-    EventQueue(EventQueue &&) = delete;
+class FabricInfo : public Handle<fi_info> {
+public:
+    FabricInfo() : Handle(fi_allocinfo()) {}
 
-    ~EventQueue() {
-        if (fi_close(&eq->fid)) {
-            perror("Closing event queue:");
-        }
+    FabricInfo(uint32_t version, const char *node, const char *service, uint64_t flags, InfoView hints) {
+        ERRCHK(fi_getinfo(version, node, service, flags, hints.get(), &obj));
     }
 
-    fid_eq *operator->() const {
-        return eq;
-    }
+    /// Takes ownership of an info that libfabric handed out, e.g. the one in an FI_CONNREQ event.
+    explicit FabricInfo(fi_info *info) noexcept: Handle(info) {}
 
-    fid_eq *get() const {
-        return eq;
+    /// Deep copy of the first entry. Handles are move-only, so copies have to be asked for.
+    FabricInfo dup() const {
+        return FabricInfo(fi_dupinfo(obj));
     }
-
-private:
-    Fabric fabric_;
-    fid_eq *eq;
 };
 
-class AccessDomain {
+class Fabric : public Handle<fid_fabric> {
 public:
-    AccessDomain(Fabric &fabric, FabricInfo &info) : ref(new std::atomic_uint(1)), info_(info), fabric_(fabric) {
-        if (fi_domain(fabric.get(), info.get(), &domain, nullptr))
-            perror("Creating access domain:");
-    }
+    Fabric() = default;
 
-    AccessDomain(AccessDomain &&other) : info_(std::move(other.info_)), fabric_(std::move(other.fabric_)) {
-        domain = other.domain;
-        ref = other.ref;
-        other.ref = nullptr;
-        other.domain = nullptr;
+    explicit Fabric(InfoView info) {
+        ERRCHK(fi_fabric(info->fabric_attr, &obj, nullptr));
     }
+};
 
-    AccessDomain(const AccessDomain & other) : info_(other.info_), fabric_(other.fabric_) {
-        other.ref->operator++();
-        domain = other.domain;
-        ref = other.ref;
-        info_ = other.info_;
-    }
+class EventQueue : public Handle<fid_eq> {
+public:
+    EventQueue() = default;
 
-    ~AccessDomain() {
-        if (domain && ref->operator--() == 0) {
-            if (fi_close(&domain->fid)) {
-                perror("Closing access domain:");
-            }
-            delete ref;
-        }
+    EventQueue(FabricView fabric, fi_eq_attr *attr) {
+        ERRCHK(fi_eq_open(fabric.get(), attr, &obj, nullptr));
     }
+};
 
-    fid_domain *operator->() const {
-        return domain;
-    }
+class AccessDomain : public Handle<fid_domain> {
+public:
+    AccessDomain() = default;
 
-    fid_domain *get() const {
-        return domain;
+    AccessDomain(FabricView fabric, InfoView info) {
+        ERRCHK(fi_domain(fabric.get(), info.get(), &obj, nullptr));
     }
-
-private:
-    fid_domain *domain;
-    std::atomic_uint *ref;
-    FabricInfo info_;
-    Fabric fabric_;
 };
 
-class CompletionQueue {
+class CompletionQueue : public Handle<fid_cq> {
 public:
-    CompletionQueue(AccessDomain &domain, fi_cq_attr *attr) : domain_(domain) {
-        if (fi_cq_open(domain_.get(), attr, &cq, nullptr)) {
-            perror("Completion queue open:");
+    CompletionQueue() = default;
+
+    CompletionQueue(DomainView domain, fi_cq_attr *attr) {
+        ERRCHK(fi_cq_open(domain.get(), attr, &obj, nullptr));
+    }
+
+    /// Reads up to count entries. An empty queue is 0 entries, not an error.
+    FabricResult<size_t> read(void *entries, size_t count) {
+        ssize_t ret = fi_cq_read(obj, entries, count);
+        if (ret > 0) [[likely]]
+            return static_cast<size_t>(ret);
+        if (ret == -FI_EAGAIN)
+            return size_t(0);
+        return FabricResult<size_t>::error(static_cast<int>(ret));
+    }
+
+    /// Spins until count entries have been read, returning the first error entry's code if one shows up
+    FabricResult<void> wait(void *entries, size_t count, size_t entry_size) {
+        char *out = static_cast<char *>(entries);
+        while (count) {
+            auto n = read(out, count);
+            if (!n) [[unlikely]]
+                return FabricResult<void>::error(n.error() == -FI_EAVAIL ? readerr() : n.error());
+            out += *n * entry_size;
+            count -= *n;
         }
+        return {};
     }
 
-    CompletionQueue(const CompletionQueue &) = delete;
-
-    CompletionQueue(CompletionQueue &&) = delete;
-
-    ~CompletionQueue() {
-        if (fi_close(&cq->fid)) {
-            perror("Closing completion queue:");
-        }
+    /// Pops an error entry, prints it and returns its (negative) error code
+    int readerr() {
+        fi_cq_err_entry err_entry = {};
+        if (fi_cq_readerr(obj, &err_entry, 0) < 0)
+            return -FI_EOTHER;
+        std::cerr << fi_strerror(err_entry.err) << " "
+                  << fi_cq_strerror(obj, err_entry.prov_errno, err_entry.err_data, nullptr, 0) << std::endl;
+        return -err_entry.err;
     }
 
-    fid_cq *operator->() const {
-        return cq;
+    /**
+     * Reads up to 16 completions of a FI_CQ_FORMAT_CONTEXT queue and calls fn(op_context, err) for each, err being 0
+     * or the failed operation's negative error code. Returns how many were handled; only a failing queue is an error.
+     */
+    template<typename Fn>
+    FabricResult<size_t> reap(Fn &&fn) {
+        return reap_entries(false, [&](void *op_context, fi_addr_t, int err) { fn(op_context, err); });
     }
 
-    fid_cq *get() const {
-        return cq;
+    /// reap() that also passes the sender's address (FI_ADDR_NOTAVAIL if unknown), fn(op_context, src, err). Needs
+    /// FI_SOURCE on the endpoint.
+    template<typename Fn>
+    FabricResult<size_t> reap_from(Fn &&fn) {
+        return reap_entries(true, fn);
     }
 
 private:
-
-    fid_cq *cq;
-    AccessDomain domain_;
-};
-
-class MemoryRegion {
-public:
-    MemoryRegion(AccessDomain &domain, const void *buf, size_t len, uint64_t access, uint64_t offset,
-                 uint64_t requested_key,
-                 uint64_t flags) : domain_(domain) {
-        if (fi_mr_reg(domain_.get(), buf, len, access, offset, requested_key, flags, &mr, NULL)) {
-            perror("");
+    template<typename Fn>
+    FabricResult<size_t> reap_entries(bool from, Fn &&fn) {
+        fi_cq_entry entries[16];
+        fi_addr_t src[16];
+        ssize_t n = from ? fi_cq_readfrom(obj, entries, 16, src) : fi_cq_read(obj, entries, 16);
+        if (n == -FI_EAGAIN)
+            return size_t(0);
+        if (n == -FI_EAVAIL) {
+            fi_cq_err_entry err_entry = {};
+            ssize_t ret = fi_cq_readerr(obj, &err_entry, 0);
+            if (ret < 0) [[unlikely]]
+                return FabricResult<size_t>::error(static_cast<int>(ret));
+            fn(err_entry.op_context, FI_ADDR_NOTAVAIL, err_entry.err ? -err_entry.err : -FI_EOTHER);
+            return size_t(1);
         }
+        if (n < 0) [[unlikely]]
+            return FabricResult<size_t>::error(static_cast<int>(n));
+        for (ssize_t i = 0; i < n; i++) {
+            fn(entries[i].op_context, from ? src[i] : FI_ADDR_NOTAVAIL, 0);
+        }
+        return static_cast<size_t>(n);
     }
+};
 
-    MemoryRegion(const MemoryRegion &) = delete;
+/**
+ * Anything posted with a context keeps an fi_context named ctx as its first member, so a completion's op_context is
+ * the address of the object that posted it.
+ */
+template<typename T>
+T *completion_owner(void *op_context) {
+    static_assert(std::is_standard_layout_v<T> && offsetof(T, ctx) == 0, "ctx has to be the first member");
+    return static_cast<T *>(op_context);
+}
 
-    MemoryRegion(MemoryRegion &&) = delete;
+class MemoryRegion : public Handle<fid_mr> {
+public:
+    MemoryRegion() = default;
 
-    ~MemoryRegion() {
-        if (fi_close(&mr->fid))
-            perror("");
+    MemoryRegion(DomainView domain, const void *buf, size_t len, uint64_t access, uint64_t offset,
+                 uint64_t requested_key, uint64_t flags) {
+        ERRCHK(fi_mr_reg(domain.get(), buf, len, access, offset, requested_key, flags, &obj, nullptr));
     }
 
-    fid_mr *operator->() const {
-        return mr;
+    void *desc() const {
+        return fi_mr_desc(obj);
     }
 
-    fid_mr *get() const {
-        return mr;
+    uint64_t key() const {
+        return fi_mr_key(obj);
     }
-private:
-
-    fid_mr *mr;
-    AccessDomain domain_;
 };
 
-class ActiveEndpoint {
+class ActiveEndpoint : public Handle<fid_ep> {
 public:
+    ActiveEndpoint() = default;
 
-    ActiveEndpoint(AccessDomain &domain, FabricInfo &info) : ref(new std::atomic_uint(1)), domain_(domain),
-                                                             info_(info) {
-        ERRCHK(fi_endpoint(domain.get(), info.get(),
-                           &ep, nullptr));
+    ActiveEndpoint(DomainView domain, InfoView info) {
+        ERRCHK(fi_endpoint(domain.get(), info.get(), &obj, nullptr));
     }
 
-    ActiveEndpoint(const ActiveEndpoint &other) : domain_(other.domain_), info_(other.info_) {
-        other.ref->fetch_add(1);
-        ep = other.ep;
-        ref = other.ref;
+    template<typename T>
+    void bind(View<T> res, uint64_t flags) {
+        ERRCHK(fi_ep_bind(obj, &res->fid, flags));
     }
 
-    ActiveEndpoint(ActiveEndpoint &&other) noexcept: domain_(std::move(other.domain_)), info_(std::move(other.info_)) {
-        ep = other.ep;
-        ref = other.ref;
-        other.ep = nullptr;
-        other.ref = nullptr;
+    template<typename T>
+    void bind(const Handle<T> &res, uint64_t flags) {
+        bind(View<T>(res), flags);
     }
 
-    ~ActiveEndpoint() {
-        if (ep) {
-            std::cerr << "Closing endpoint" << std::endl;
-            ERRCHK(fi_close(&ep->fid));
-        }
+    void enable() {
+        ERRCHK(fi_enable(obj));
     }
 
-    fid_ep *operator->() {
-        return ep;
-    }
+    // Data path. These hand -FI_EAGAIN back to the caller; wrap them in fabric_retry to keep posting under
+    // back-pressure.
 
-    fid_ep *get() {
-        return ep;
+    FabricResult<void> send(const void *buf, size_t len, void *desc, fi_addr_t dest, void *context = nullptr) {
+        return fabric_status(fi_send(obj, buf, len, desc, dest, context));
     }
 
-    void enable() {
-        ERRCHK(fi_enable(ep));
+    FabricResult<void> recv(void *buf, size_t len, void *desc, fi_addr_t src, void *context = nullptr) {
+        return fabric_status(fi_recv(obj, buf, len, desc, src, context));
     }
 
-    //void bind(CompletionQueue &cq, uint64_t flags) {
-    //    ERRCHK(fi_ep_bind(ep, &cq->fid, flags));
-    //    boundCQs.push_front(cq);
-    //}
-
-private:
-    fid_ep *ep;
-    std::atomic_uint *ref;
-    AccessDomain domain_;
-    FabricInfo info_;
-};
-
-class AddressVector {
-public:
-
-    AddressVector(AccessDomain &domain, fi_av_attr *attr) : ref(new std::atomic_uint(1)), domain_(domain) {
-        ERRCHK(fi_av_open(domain.get(), attr, &av, nullptr));
+    FabricResult<void> inject(const void *buf, size_t len, fi_addr_t dest) {
+        return fabric_status(fi_inject(obj, buf, len, dest));
     }
 
-    AddressVector(const AddressVector &other) : domain_(other.domain_) {
-        av = other.av;
-        ref = other.ref;
-        ref->operator++();
+    FabricResult<void> write(const void *buf, size_t len, void *desc, fi_addr_t dest, uint64_t addr, uint64_t key,
+                             void *context = nullptr) {
+        return fabric_status(fi_write(obj, buf, len, desc, dest, addr, key, context));
     }
 
-    AddressVector(AddressVector &&other) noexcept: domain_(std::move(other.domain_)) {
-        av = other.av;
-        ref = other.ref;
-        other.av = nullptr;
-        other.ref = nullptr;
+    FabricResult<void> read(void *buf, size_t len, void *desc, fi_addr_t src, uint64_t addr, uint64_t key,
+                            void *context = nullptr) {
+        return fabric_status(fi_read(obj, buf, len, desc, src, addr, key, context));
     }
+};
 
-    ~AddressVector() {
-        if (av && ref->fetch_sub(1) - 1 == 0) {
-            ERRCHK(fi_close(&av->fid));
-        }
-    }
+class AddressVector : public Handle<fid_av> {
+public:
+    AddressVector() = default;
 
-    fid_av *operator->() {
-        return av;
+    AddressVector(DomainView domain, fi_av_attr *attr) {
+        ERRCHK(fi_av_open(domain.get(), attr, &obj, nullptr));
     }
 
-    fid_av *get() {
-        return av;
+    /// Inserts one address and returns its fi_addr_t
+    fi_addr_t insert(const void *addr) {
+        fi_addr_t out = FI_ADDR_UNSPEC;
+        int ret = fi_av_insert(obj, addr, 1, &out, 0, nullptr);
+        if (ret != 1)
+            throw FabricError(ret < 0 ? ret : -FI_EINVAL, __FILE__, __LINE__);
+        return out;
     }
-
-private:
-    fid_av *av;
-    std::atomic_uint *ref;
-    AccessDomain domain_;
 };
 
 #endif //NETWORKLAYER_FABRICCXX_HH
@@ -0,0 +1,181 @@
+//
+// Error channel for the wrappers. Setup code throws FabricError, hot paths return a FabricResult so the caller can
+// deal with -FI_EAGAIN (back-pressure) instead of the process exiting.
+//
+
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_errno.h>
+
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#ifndef NETWORKLAYER_FABRICRESULT_HH
+#define NETWORKLAYER_FABRICRESULT_HH
+
+class FabricError : public std::runtime_error {
+public:
+    /// err is a libfabric return code, so it is negative (-FI_EAGAIN, ...)
+    explicit FabricError(int err) : std::runtime_error(fi_strerror(-err)), code_(err) {}
+
+    FabricError(int err, const char *file, int line)
+            : std::runtime_error(std::string(fi_strerror(-err)) + " (" + std::to_string(err) + ") at " + file +
+                                 ":" + std::to_string(line)), code_(err) {}
+
+    int code() const noexcept {
+        return code_;
+    }
+
+private:
+    int code_;
+};
+
+/**
+ * std::expected style result: either a value or a negative libfabric error code. Kept to trivially copyable values
+ * (counts, sizes) so it is returned in registers.
+ */
+template<typename T>
+class [[nodiscard]] FabricResult {
+public:
+    FabricResult(T value) noexcept: value_(value), err(0) {}
+
+    static FabricResult error(int err) noexcept {
+        FabricResult r{T{}};
+        r.err = err;
+        return r;
+    }
+
+    bool has_value() const noexcept {
+        return err == 0;
+    }
+
+    explicit operator bool() const noexcept {
+        return has_value();
+    }
+
+    /// Error code, 0 if there is a value
+    int error() const noexcept {
+        return err;
+    }
+
+    bool again() const noexcept {
+        return err == -FI_EAGAIN;
+    }
+
+    T value() const {
+        if (err) [[unlikely]]
+            throw FabricError(err);
+        return value_;
+    }
+
+    T value_or(T other) const noexcept {
+        return err ? other : value_;
+    }
+
+    T operator*() const noexcept {
+        return value_;
+    }
+
+private:
+    T value_;
+    int err;
+};
+
+template<>
+class [[nodiscard]] FabricResult<void> {
+public:
+    FabricResult() noexcept: err(0) {}
+
+    static FabricResult error(int err) noexcept {
+        FabricResult r;
+        r.err = err;
+        return r;
+    }
+
+    bool has_value() const noexcept {
+        return err == 0;
+    }
+
+    explicit operator bool() const noexcept {
+        return has_value();
+    }
+
+    int error() const noexcept {
+        return err;
+    }
+
+    bool again() const noexcept {
+        return err == -FI_EAGAIN;
+    }
+
+    void value() const {
+        if (err) [[unlikely]]
+            throw FabricError(err);
+    }
+
+private:
+    int err;
+};
+
+/// Turns a libfabric status return (0 or -errno) into a result
+inline FabricResult<void> fabric_status(ssize_t ret) noexcept {
+    if (ret == 0) [[likely]]
+        return {};
+    return FabricResult<void>::error(static_cast<int>(ret < 0 ? ret : -FI_EOTHER));
+}
+
+/// Turns a libfabric count return (n >= 0 or -errno) into a result
+inline FabricResult<size_t> fabric_count(ssize_t ret) noexcept {
+    if (ret >= 0) [[likely]]
+        return static_cast<size_t>(ret);
+    return FabricResult<size_t>::error(static_cast<int>(ret));
+}
+
+/**
+ * Posts op until it stops returning -FI_EAGAIN, calling progress() in between. Any other error is returned as is.
+ * progress is what lets the provider drain its queues; which one depends on how the endpoint reports completions,
+ * so there are overloads for CQs and counters below. If the CQ itself can fill up, pass a progress function that
+ * reaps completions into your own bookkeeping. A progress function returning FabricResult<void> ends the retry with
+ * its error, otherwise a broken queue would keep op at -FI_EAGAIN forever.
+ */
+template<typename Progress, typename Op>
+FabricResult<void> fabric_retry_with(Progress &&progress, Op &&op) {
+    while (true) {
+        ssize_t ret = op();
+        if (ret != -FI_EAGAIN) [[likely]]
+            return fabric_status(ret);
+        if constexpr (std::is_same_v<decltype(progress()), FabricResult<void>>) {
+            auto progressed = progress();
+            if (!progressed) [[unlikely]]
+                return progressed;
+        } else {
+            progress();
+        }
+    }
+}
+
+/**
+ * Retry against a CQ without consuming completions. Reading zero entries still drives manual progress, so the
+ * caller's own completion loop sees everything. If that read reports an error (an error entry waiting with
+ * -FI_EAVAIL, or an overrun queue) the retry stops and returns it, the caller has to reap the CQ first.
+ */
+template<typename Op>
+FabricResult<void> fabric_retry(fid_cq *cq, Op &&op) {
+    return fabric_retry_with([cq]() {
+        ssize_t ret = fi_cq_read(cq, nullptr, 0);
+        if (ret < 0 && ret != -FI_EAGAIN) [[unlikely]]
+            return FabricResult<void>::error(static_cast<int>(ret));
+        return FabricResult<void>();
+    }, std::forward<Op>(op));
+}
+
+template<typename Op>
+FabricResult<void> fabric_retry(fid_cntr *cntr, Op &&op) {
+    return fabric_retry_with([cntr]() {
+        (void) fi_cntr_read(cntr);
+    }, std::forward<Op>(op));
+}
+
+#endif //NETWORKLAYER_FABRICRESULT_HH
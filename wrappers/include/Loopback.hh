@@ -0,0 +1,222 @@
+//
+// Two endpoints of one provider connected to each other inside a single process. The provider probe and the
+// benchmarks use this to measure a provider without a second node.
+//
+
+#include <Fabric.hh>
+
+#include <rdma/fi_cm.h>
+#include <rdma/fi_eq.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifndef NETWORKLAYER_LOOPBACK_HH
+#define NETWORKLAYER_LOOPBACK_HH
+
+class LoopbackPair {
+public:
+    /**
+     * info is a single fi_info entry. MSG endpoints are connected through a passive endpoint, RDM and DGRAM ones
+     * through a shared address vector. Each side gets one CQ for both directions. Throws FabricError on failure.
+     */
+    explicit LoopbackPair(InfoView info, int timeout_ms = 2000) : info(fi_dupinfo(info.get())), fabric(this->info),
+                                                                  domain(fabric, this->info), timeout_ms(timeout_ms) {
+        fi_cq_attr cq_attr = {};
+        cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+        cq_attr.wait_obj = FI_WAIT_NONE;
+        for (auto &q : cq) {
+            q = CompletionQueue(domain, &cq_attr);
+        }
+
+        if (type() == FI_EP_MSG) {
+            connect_msg();
+        } else {
+            connect_av();
+        }
+    }
+
+    fi_ep_type type() const {
+        return info->ep_attr->type;
+    }
+
+    FabricInfo info;
+    Fabric fabric;
+    AccessDomain domain;
+    EventQueue eq;
+    AddressVector av;
+    CompletionQueue cq[2];
+    Handle<fid_pep> pep;
+    ActiveEndpoint ep[2];
+    /// peer[i] is how side i addresses the other side (FI_ADDR_UNSPEC for connected endpoints)
+    fi_addr_t peer[2] = {FI_ADDR_UNSPEC, FI_ADDR_UNSPEC};
+
+private:
+    void setup_ep(int side, InfoView ep_info, bool bind_eq) {
+        ep[side] = ActiveEndpoint(domain, ep_info);
+        if (bind_eq) {
+            ep[side].bind(eq, 0);
+        } else {
+            ep[side].bind(av, 0);
+        }
+        ep[side].bind(cq[side], FI_TRANSMIT | FI_RECV);
+        ep[side].enable();
+    }
+
+    void connect_av() {
+        fi_av_attr av_attr = {};
+        av_attr.type = info->domain_attr->av_type;
+        av_attr.count = 2;
+        av = AddressVector(domain, &av_attr);
+
+        setup_ep(0, info, false);
+        setup_ep(1, info, false);
+
+        peer[0] = av.insert(endpoint_name(&ep[1]->fid).data());
+        peer[1] = av.insert(endpoint_name(&ep[0]->fid).data());
+    }
+
+    void connect_msg() {
+        fi_eq_attr eq_attr = {};
+        eq_attr.wait_obj = FI_WAIT_UNSPEC;
+        eq = EventQueue(fabric, &eq_attr);
+
+        fid_pep *raw_pep;
+        ERRCHK(fi_passive_ep(fabric.get(), info.get(), &raw_pep, nullptr));
+        pep = Handle<fid_pep>(raw_pep);
+        ERRCHK(fi_pep_bind(pep.get(), &eq->fid, 0));
+        ERRCHK(fi_listen(pep.get()));
+
+        // Side 0 connects to wherever the passive endpoint ended up listening
+        std::vector<char> name = endpoint_name(&pep->fid);
+        FabricInfo client = info.dup();
+        free(client->dest_addr);
+        client->dest_addr = malloc(name.size());
+        memcpy(client->dest_addr, name.data(), name.size());
+        client->dest_addrlen = name.size();
+
+        setup_ep(0, client, true);
+        ERRCHK(fi_connect(ep[0].get(), name.data(), nullptr, 0));
+
+        fi_eq_cm_entry entry = {};
+        wait_event(FI_CONNREQ, entry);
+        FabricInfo request(entry.info);
+        setup_ep(1, request, true);
+        ERRCHK(fi_accept(ep[1].get(), nullptr, 0));
+
+        wait_event(FI_CONNECTED, entry);
+        wait_event(FI_CONNECTED, entry);
+    }
+
+    void wait_event(uint32_t expected, fi_eq_cm_entry &entry) {
+        uint32_t event = 0;
+        ssize_t rd = fi_eq_sread(eq.get(), &event, &entry, sizeof(entry), timeout_ms, 0);
+        if (rd == -FI_EAVAIL) {
+            fi_eq_err_entry err = {};
+            fi_eq_readerr(eq.get(), &err, 0);
+            throw FabricError(-err.err, __FILE__, __LINE__);
+        }
+        if (rd < 0)
+            throw FabricError(static_cast<int>(rd), __FILE__, __LINE__);
+        if (event != expected)
+            throw FabricError(-FI_EOTHER, __FILE__, __LINE__);
+    }
+
+    int timeout_ms;
+};
+
+/**
+ * depth receives of size bytes each, kept posted on one side of a pair whose CQ sees nothing else. The benchmarks
+ * receive through it. The destructor cancels what is still posted and drains the CQ, so whoever uses the pair next
+ * does not match stale receives into freed buffers.
+ */
+class RecvRing {
+public:
+    RecvRing(LoopbackPair &pair, int side, size_t size, size_t depth, uint64_t requested_key = 0)
+            : pair(pair), side(side), size(size), buf(size * depth), slots(depth) {
+        mr = MemoryRegion(pair.domain, buf.data(), buf.size(), FI_RECV, 0, requested_key, 0);
+        for (size_t i = 0; i < depth; i++) {
+            post(i);
+        }
+    }
+
+    RecvRing(const RecvRing &) = delete;
+
+    RecvRing &operator=(const RecvRing &) = delete;
+
+    ~RecvRing() {
+        for (auto &slot : slots) {
+            if (slot.busy)
+                (void) fi_cancel(&pair.ep[side]->fid, &slot.ctx);
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (posted() && std::chrono::steady_clock::now() < deadline) {
+            auto reaped = pair.cq[side].reap([](void *op_context, int) {
+                if (op_context)
+                    completion_owner<Slot>(op_context)->busy = false;
+            });
+            if (!reaped)
+                break;
+        }
+        // Nothing can land in the buffer once the endpoint is gone
+        if (posted()) [[unlikely]]
+            pair.ep[side] = ActiveEndpoint();
+    }
+
+    /// Polls the CQ once, calls fn(data) for every receive that completed and posts it again. Returns how many.
+    template<typename Fn>
+    size_t poll(Fn &&fn) {
+        size_t received = 0;
+        int failed = 0;
+        auto reaped = pair.cq[side].reap([&](void *op_context, int err) {
+            if (!op_context)
+                return;
+            Slot *slot = completion_owner<Slot>(op_context);
+            slot->busy = false;
+            if (err) {
+                if (!failed)
+                    failed = err;
+                return;
+            }
+            size_t i = slot - slots.data();
+            fn(static_cast<const char *>(buf.data() + i * size));
+            received++;
+            post(i);
+        });
+        if (!reaped) [[unlikely]]
+            throw FabricError(reaped.error(), __FILE__, __LINE__);
+        if (failed) [[unlikely]]
+            throw FabricError(failed, __FILE__, __LINE__);
+        return received;
+    }
+
+private:
+    struct Slot {
+        fi_context ctx;
+        bool busy = false;
+    };
+
+    void post(size_t i) {
+        fabric_retry(pair.cq[side].get(), [&]() {
+            return fi_recv(pair.ep[side].get(), buf.data() + i * size, size, mr.desc(), pair.peer[side],
+                           &slots[i].ctx);
+        }).value();
+        slots[i].busy = true;
+    }
+
+    size_t posted() const {
+        return std::count_if(slots.begin(), slots.end(), [](const Slot &slot) { return slot.busy; });
+    }
+
+    LoopbackPair &pair;
+    int side;
+    size_t size;
+    std::vector<char> buf;
+    MemoryRegion mr;
+    std::vector<Slot> slots;
+};
+
+#endif //NETWORKLAYER_LOOPBACK_HH
@@ -0,0 +1,286 @@
+//
+// Memory registration cache for buffers the application hands us, so sending from the same heap memory again does not
+// pay for fi_mr_reg every time.
+//
+// Registered ranges are page aligned and kept disjoint: a miss that overlaps or touches existing ranges registers
+// their union and retires them, so the ranges in the map never overlap and a lookup is one std::map::upper_bound,
+// O(log n). Entries nobody is using sit in an LRU list and are closed once the pinned bytes go over budget.
+//
+// The cache cannot see free() or munmap(). Call invalidate() on a range before giving it back to the system,
+// otherwise a later allocation at the same address would be sent with a stale registration.
+//
+// Not thread safe, use one cache per thread or lock around it.
+//
+
+#include <Fabric.hh>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <tuple>
+#include <utility>
+
+#ifndef NETWORKLAYER_MRCACHE_HH
+#define NETWORKLAYER_MRCACHE_HH
+
+/// Registers ranges in a domain. The cache only needs reg() and the Region type, tests swap in a fake.
+struct DomainRegistrar {
+    using Region = MemoryRegion;
+
+    DomainRegistrar(DomainView domain, uint64_t access) : domain(domain), access(access) {}
+
+    Region reg(const void *buf, size_t len) {
+        return MemoryRegion(domain, buf, len, access, 0, next_key++, 0);
+    }
+
+    DomainView domain;
+    uint64_t access;
+    uint64_t next_key = 1;
+};
+
+template<typename Registrar>
+class BasicMRCache {
+    using Region = typename Registrar::Region;
+
+    struct Entry {
+        uintptr_t start;
+        uintptr_t end;
+        Region region;
+        size_t refs;
+    };
+
+    using EntryList = std::list<Entry>;
+
+public:
+    /// A registered range in use. Keeps the registration alive until it is destroyed, even if it gets invalidated.
+    class Ref {
+    public:
+        Ref() = default;
+
+        Ref(const Ref &) = delete;
+
+        Ref &operator=(const Ref &) = delete;
+
+        Ref(Ref &&other) noexcept: cache(std::exchange(other.cache, nullptr)), entry(other.entry) {}
+
+        Ref &operator=(Ref &&other) noexcept {
+            if (&other != this) {
+                reset();
+                cache = std::exchange(other.cache, nullptr);
+                entry = other.entry;
+            }
+            return *this;
+        }
+
+        ~Ref() {
+            reset();
+        }
+
+        void reset() {
+            if (cache)
+                std::exchange(cache, nullptr)->release(entry);
+        }
+
+        const Region &region() const {
+            return entry->region;
+        }
+
+        void *desc() const {
+            return entry->region.desc();
+        }
+
+        uint64_t key() const {
+            return entry->region.key();
+        }
+
+        explicit operator bool() const {
+            return cache != nullptr;
+        }
+
+    private:
+        friend class BasicMRCache;
+
+        Ref(BasicMRCache *cache, typename EntryList::iterator entry) : cache(cache), entry(entry) {}
+
+        BasicMRCache *cache = nullptr;
+        typename EntryList::iterator entry;
+    };
+
+    BasicMRCache(Registrar registrar, size_t max_pinned)
+            : registrar(std::move(registrar)), max_pinned(max_pinned), page(sysconf(_SC_PAGESIZE)) {}
+
+    BasicMRCache(const BasicMRCache &) = delete;
+
+    BasicMRCache &operator=(const BasicMRCache &) = delete;
+
+    /// Registration covering [buf, buf + len). Throws FabricError if registering fails.
+    Ref acquire(const void *buf, size_t len) {
+        uintptr_t start = reinterpret_cast<uintptr_t>(buf);
+        uintptr_t end = start + std::max<size_t>(len, 1);
+
+        auto found = lookup(start);
+        if (found != ranges.end() && end <= found->second->end) [[likely]] {
+            hit_count++;
+            found->second->refs++;
+            return Ref(this, found->second);
+        }
+
+        miss_count++;
+        start &= ~(page - 1);
+        end = (end + page - 1) & ~(page - 1);
+
+        // Grow to cover every range that overlaps or touches this one
+        auto [first, last] = overlapping(start, end, true);
+        uintptr_t merged_start = start, merged_end = end;
+        for (auto it = first; it != last; ++it) {
+            merged_start = std::min(merged_start, it->second->start);
+            merged_end = std::max(merged_end, it->second->end);
+        }
+
+        typename EntryList::iterator entry;
+        try {
+            entry = insert(merged_start, merged_end);
+        } catch (const FabricError &) {
+            // The union may span memory that cannot be registered in one piece, fall back to just this range
+            if (merged_start == start && merged_end == end)
+                throw;
+            entry = insert(start, end);
+            std::tie(first, last) = overlapping(start, end, false);
+        }
+        for (auto it = first; it != last;) {
+            retire((it++)->second);
+        }
+        ranges[entry->start] = entry;
+        evict();
+        return Ref(this, entry);
+    }
+
+    /// Drops every registration overlapping [buf, buf + len). Ranges still in use stay registered until released.
+    void invalidate(const void *buf, size_t len) {
+        uintptr_t start = reinterpret_cast<uintptr_t>(buf);
+        auto [first, last] = overlapping(start, start + len, false);
+        for (auto it = first; it != last;) {
+            retire((it++)->second);
+        }
+    }
+
+    /// Bytes currently registered, including invalidated ranges that are still in use
+    size_t pinned() const {
+        return pinned_bytes;
+    }
+
+    /// Ranges that can be looked up
+    size_t size() const {
+        return ranges.size();
+    }
+
+    size_t hits() const {
+        return hit_count;
+    }
+
+    size_t misses() const {
+        return miss_count;
+    }
+
+    size_t evictions() const {
+        return eviction_count;
+    }
+
+private:
+    using RangeMap = std::map<uintptr_t, typename EntryList::iterator>;
+
+    /// Range containing addr, or end()
+    typename RangeMap::iterator lookup(uintptr_t addr) {
+        auto it = ranges.upper_bound(addr);
+        if (it == ranges.begin())
+            return ranges.end();
+        --it;
+        return addr < it->second->end ? it : ranges.end();
+    }
+
+    /// Ranges overlapping [start, end), plus the ones right next to it if touching is set
+    std::pair<typename RangeMap::iterator, typename RangeMap::iterator>
+    overlapping(uintptr_t start, uintptr_t end, bool touching) {
+        auto first = ranges.lower_bound(start);
+        if (first != ranges.begin()) {
+            auto prev = std::prev(first);
+            if (prev->second->end > start || (touching && prev->second->end == start))
+                first = prev;
+        }
+        auto last = first;
+        while (last != ranges.end() && (last->first < end || (touching && last->first == end)))
+            ++last;
+        return {first, last};
+    }
+
+    /// Registers [start, end) as a new in-use entry at the front of the LRU, not yet in the map
+    typename EntryList::iterator insert(uintptr_t start, uintptr_t end) {
+        Region region = registrar.reg(reinterpret_cast<const void *>(start), end - start);
+        lru.push_front(Entry{start, end, std::move(region), 1});
+        pinned_bytes += end - start;
+        return lru.begin();
+    }
+
+    /// Takes an entry out of the map. Unused ones are closed now, used ones when their last Ref goes.
+    void retire(typename EntryList::iterator entry) {
+        auto it = ranges.find(entry->start);
+        if (it != ranges.end() && it->second == entry)
+            ranges.erase(it);
+        if (entry->refs == 0) {
+            close(lru, entry);
+        } else {
+            retired.splice(retired.end(), lru, entry);
+        }
+    }
+
+    void release(typename EntryList::iterator entry) {
+        if (--entry->refs)
+            return;
+        auto it = ranges.find(entry->start);
+        if (it != ranges.end() && it->second == entry) {
+            lru.splice(lru.begin(), lru, entry);
+            evict();
+        } else {
+            close(retired, entry);
+        }
+    }
+
+    /// Closes unused entries, least recently used first, until the budget is met
+    void evict() {
+        auto it = lru.end();
+        while (pinned_bytes > max_pinned && it != lru.begin()) {
+            --it;
+            if (it->refs)
+                continue;
+            ranges.erase(it->start);
+            eviction_count++;
+            close(lru, it++);
+        }
+    }
+
+    void close(EntryList &list, typename EntryList::iterator entry) {
+        pinned_bytes -= entry->end - entry->start;
+        list.erase(entry);
+    }
+
+    Registrar registrar;
+    size_t max_pinned;
+    uintptr_t page;
+    /// start -> entry, disjoint ranges only
+    RangeMap ranges;
+    /// Most recently released first. Holds everything in the map.
+    EntryList lru;
+    /// Invalidated or merged away but still referenced
+    EntryList retired;
+    size_t pinned_bytes = 0;
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+    size_t eviction_count = 0;
+};
+
+using MRCache = BasicMRCache<DomainRegistrar>;
+
+#endif //NETWORKLAYER_MRCACHE_HH
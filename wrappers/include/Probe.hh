@@ -0,0 +1,438 @@
+//
+// Provider auto-selection. Every fi_info returned for the required caps is tried with a short ping-pong over a
+// LoopbackPair and the fastest one wins. The winner is written to a small cache file so later start-ups can skip
+// the probing and go straight to fi_getinfo for that provider.
+//
+
+#include <Fabric.hh>
+#include <Loopback.hh>
+
+#include <rdma/fi_tagged.h>
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifndef NETWORKLAYER_PROBE_HH
+#define NETWORKLAYER_PROBE_HH
+
+struct ProbeOptions {
+    /// Capabilities the application needs, e.g. FI_MSG | FI_RMA
+    uint64_t caps = FI_MSG;
+    /// FI_EP_UNSPEC lets the probe pick the endpoint type too
+    fi_ep_type ep_type = FI_EP_UNSPEC;
+    size_t msg_size = 64;
+    int iterations = 1000;
+    int timeout_ms = 2000;
+};
+
+struct ProbeResult {
+    FabricInfo info;
+    /// Half round trip of the ping-pong, only meaningful if error is 0
+    double latency_us = 0;
+    int error = 0;
+
+    std::string describe() const {
+        return describe(info);
+    }
+
+    static std::string describe(InfoView info) {
+        return std::string(info->fabric_attr->prov_name) + " " + info->fabric_attr->name + " " +
+               info->domain_attr->name + " " + ep_type_name(info->ep_attr->type);
+    }
+
+    static const char *ep_type_name(fi_ep_type type) {
+        switch (type) {
+            case FI_EP_MSG:
+                return "FI_EP_MSG";
+            case FI_EP_RDM:
+                return "FI_EP_RDM";
+            case FI_EP_DGRAM:
+                return "FI_EP_DGRAM";
+            default:
+                return "FI_EP_UNSPEC";
+        }
+    }
+};
+
+/// Hints for what the wrappers can drive: caller supplied contexts and the usual memory registration modes
+inline FabricInfo probe_hints(const ProbeOptions &opts) {
+    FabricInfo hints;
+    hints->caps = opts.caps;
+    hints->mode = FI_CONTEXT;
+    hints->ep_attr->type = opts.ep_type;
+    hints->domain_attr->mr_mode = FI_MR_LOCAL | FI_MR_VIRT_ADDR | FI_MR_ALLOCATED | FI_MR_PROV_KEY;
+    return hints;
+}
+
+/// fi_getinfo for probe_hints(opts), narrowed to provider unless that is null. Throws FabricError if nothing matches.
+inline FabricInfo provider_info(const ProbeOptions &opts, const char *provider, const char *node = nullptr,
+                                const char *service = nullptr, uint64_t flags = 0) {
+    FabricInfo hints = probe_hints(opts);
+    if (provider)
+        hints->fabric_attr->prov_name = strdup(provider);
+    return FabricInfo(FIVersion, node, service, flags, hints);
+}
+
+/**
+ * One ping-pong between the two sides of a pair, over the operation the caps ask for: with FI_RMA an fi_write of the
+ * payload followed by a flag write the peer polls for, otherwise fi_tsend/fi_trecv with FI_TAGGED and fi_send/fi_recv
+ * with FI_MSG. Any other caps throw FabricError(-FI_ENOSYS). The destructor cancels the posted receives and waits
+ * for everything still in flight, so nothing targets the buffers once they are freed.
+ */
+class PingPong {
+public:
+    PingPong(LoopbackPair &pair, uint64_t caps, size_t msg_size, int timeout_ms)
+            : pair(pair), msg_size(msg_size), timeout_ms(timeout_ms) {
+        if (caps & FI_RMA) {
+            op = Op::write;
+        } else if (caps & FI_TAGGED) {
+            op = Op::tagged;
+        } else if (caps & FI_MSG) {
+            op = Op::msg;
+        } else {
+            throw FabricError(-FI_ENOSYS, __FILE__, __LINE__);
+        }
+
+        // Payloads written out of order may overtake each other, so the flag waits for delivery complete then
+        fi_info *info = pair.info.get();
+        ordered = (info->tx_attr->msg_order & FI_ORDER_WAW) && msg_size <= info->ep_attr->max_order_waw_size;
+        bool virt_addr = info->domain_attr->mr_mode == FI_MR_BASIC || (info->domain_attr->mr_mode & FI_MR_VIRT_ADDR);
+        uint64_t access = op == Op::write ? FI_WRITE | FI_REMOTE_WRITE : FI_SEND | FI_RECV;
+
+        // Per side: payload to send, payload received, flag written by the peer, flag value to write
+        flag_offset = (2 * msg_size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+        for (int i = 0; i < 2; i++) {
+            Side &s = side[i];
+            s.buf.assign(flag_offset + 2 * sizeof(uint64_t), 0);
+            s.mr = MemoryRegion(pair.domain, s.buf.data(), s.buf.size(), access, 0, i, 0);
+            s.desc = s.mr.desc();
+            s.base = virt_addr ? reinterpret_cast<uint64_t>(s.buf.data()) : 0;
+        }
+
+        if (op != Op::write) {
+            post_recv(0);
+            post_recv(1);
+        }
+    }
+
+    PingPong(const PingPong &) = delete;
+
+    PingPong &operator=(const PingPong &) = delete;
+
+    ~PingPong() {
+        for (int i = 0; i < 2; i++) {
+            if (side[i].rx.busy)
+                (void) fi_cancel(&pair.ep[i]->fid, &side[i].rx.ctx);
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        try {
+            while (busy() && std::chrono::steady_clock::now() < deadline) {
+                poll(0);
+                poll(1);
+            }
+        } catch (const FabricError &) {
+        }
+        // Nothing can land in the buffers once the endpoints are gone
+        if (busy()) [[unlikely]] {
+            pair.ep[0] = ActiveEndpoint();
+            pair.ep[1] = ActiveEndpoint();
+        }
+    }
+
+    /// Half round trip in microseconds, averaged over iterations after a short warm-up
+    double run(int iterations) {
+        int warmup = iterations / 10 + 1;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = -warmup; i < iterations; i++) {
+            if (i == 0)
+                start = std::chrono::steady_clock::now();
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            ping(0, deadline);
+            wait_ping(1, deadline);
+            ping(1, deadline);
+            wait_ping(0, deadline);
+        }
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / iterations / 2;
+    }
+
+private:
+    using Deadline = std::chrono::steady_clock::time_point;
+
+    enum class Op {
+        msg,
+        tagged,
+        write
+    };
+
+    struct OpContext {
+        fi_context ctx;
+        bool busy = false;
+    };
+
+    struct Side {
+        std::vector<char> buf;
+        MemoryRegion mr;
+        void *desc = nullptr;
+        /// Address of buf as the peer writes to it
+        uint64_t base = 0;
+        OpContext tx;
+        OpContext flag_tx;
+        OpContext rx;
+        /// Pings sent by this side
+        uint64_t sent = 0;
+    };
+
+    char *rx_area(int i) {
+        return side[i].buf.data() + msg_size;
+    }
+
+    std::atomic_ref<uint64_t> flag_in(int i) {
+        return std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t *>(side[i].buf.data() + flag_offset));
+    }
+
+    uint64_t *flag_out(int i) {
+        return reinterpret_cast<uint64_t *>(side[i].buf.data() + flag_offset + sizeof(uint64_t));
+    }
+
+    bool busy() const {
+        for (auto &s : side) {
+            if (s.tx.busy || s.flag_tx.busy || s.rx.busy)
+                return true;
+        }
+        return false;
+    }
+
+    void poll(int i) {
+        auto reaped = pair.cq[i].reap([&](void *op_context, int err) {
+            if (op_context)
+                completion_owner<OpContext>(op_context)->busy = false;
+            if (err && err != -FI_ECANCELED && !failed)
+                failed = err;
+        });
+        if (!reaped) [[unlikely]]
+            throw FabricError(reaped.error(), __FILE__, __LINE__);
+    }
+
+    void progress() {
+        poll(0);
+        poll(1);
+        if (failed) [[unlikely]]
+            throw FabricError(failed, __FILE__, __LINE__);
+    }
+
+    void wait(const OpContext &c, Deadline deadline) {
+        while (c.busy) {
+            progress();
+            if (std::chrono::steady_clock::now() > deadline) [[unlikely]]
+                throw FabricError(-FI_ETIMEDOUT, __FILE__, __LINE__);
+        }
+    }
+
+    /// Posts op with c as its context, which must not be in use any more
+    template<typename Fn>
+    void post(OpContext &c, Fn &&fn) {
+        fabric_retry_with([this]() { progress(); }, fn).value();
+        c.busy = true;
+    }
+
+    void post_recv(int i) {
+        Side &s = side[i];
+        post(s.rx, [&]() {
+            if (op == Op::tagged)
+                return fi_trecv(pair.ep[i].get(), rx_area(i), msg_size, s.desc, pair.peer[i], 0, 0, &s.rx.ctx);
+            return fi_recv(pair.ep[i].get(), rx_area(i), msg_size, s.desc, pair.peer[i], &s.rx.ctx);
+        });
+    }
+
+    void write(int i, void *buf, size_t len, uint64_t remote_offset, OpContext &c, uint64_t flags) {
+        Side &s = side[i];
+        Side &peer = side[1 - i];
+        iovec iov = {buf, len};
+        fi_rma_iov rma_iov = {peer.base + remote_offset, len, peer.mr.key()};
+        fi_msg_rma msg = {};
+        msg.msg_iov = &iov;
+        msg.desc = &s.desc;
+        msg.iov_count = 1;
+        msg.addr = pair.peer[i];
+        msg.rma_iov = &rma_iov;
+        msg.rma_iov_count = 1;
+        msg.context = &c.ctx;
+        post(c, [&]() { return fi_writemsg(pair.ep[i].get(), &msg, flags); });
+    }
+
+    void ping(int i, Deadline deadline) {
+        Side &s = side[i];
+        wait(s.tx, deadline);
+        s.sent++;
+        if (op == Op::msg) {
+            post(s.tx, [&]() {
+                return fi_send(pair.ep[i].get(), s.buf.data(), msg_size, s.desc, pair.peer[i], &s.tx.ctx);
+            });
+        } else if (op == Op::tagged) {
+            post(s.tx, [&]() {
+                return fi_tsend(pair.ep[i].get(), s.buf.data(), msg_size, s.desc, pair.peer[i], 0, &s.tx.ctx);
+            });
+        } else {
+            write(i, s.buf.data(), msg_size, msg_size, s.tx, FI_COMPLETION | (ordered ? 0 : FI_DELIVERY_COMPLETE));
+            if (!ordered)
+                wait(s.tx, deadline);
+            wait(s.flag_tx, deadline);
+            *flag_out(i) = s.sent;
+            write(i, flag_out(i), sizeof(uint64_t), flag_offset, s.flag_tx, FI_COMPLETION);
+        }
+    }
+
+    void wait_ping(int i, Deadline deadline) {
+        if (op == Op::write) {
+            uint64_t expected = side[1 - i].sent;
+            while (flag_in(i).load(std::memory_order_acquire) < expected) {
+                progress();
+                if (std::chrono::steady_clock::now() > deadline) [[unlikely]]
+                    throw FabricError(-FI_ETIMEDOUT, __FILE__, __LINE__);
+            }
+            return;
+        }
+        wait(side[i].rx, deadline);
+        post_recv(i);
+    }
+
+    LoopbackPair &pair;
+    size_t msg_size;
+    int timeout_ms;
+    Op op;
+    bool ordered;
+    size_t flag_offset;
+    Side side[2];
+    int failed = 0;
+};
+
+/**
+ * Ping-pong msg_size bytes between the two sides with the operation caps asks for (see PingPong) and return the half
+ * round trip in microseconds. Throws FabricError with -FI_ETIMEDOUT if a message does not show up within
+ * timeout_ms (DGRAM may simply drop it).
+ */
+inline double pingpong_latency_us(LoopbackPair &pair, uint64_t caps, size_t msg_size, int iterations,
+                                  int timeout_ms) {
+    PingPong pingpong(pair, caps, msg_size, timeout_ms);
+    return pingpong.run(iterations);
+}
+
+/// Probes every distinct provider/fabric/domain/endpoint type that fi_getinfo offers for opts
+inline std::vector<ProbeResult> probe_providers(const ProbeOptions &opts) {
+    FabricInfo hints = probe_hints(opts);
+    fi_info *list = nullptr;
+    std::vector<ProbeResult> results;
+    if (fi_getinfo(FIVersion, nullptr, nullptr, 0, hints.get(), &list))
+        return results;
+    FabricInfo owner(list);
+
+    std::set<std::string> seen;
+    for (fi_info *cur = list; cur; cur = cur->next) {
+        if (!seen.insert(ProbeResult::describe(cur)).second)
+            continue;
+
+        ProbeResult result;
+        result.info = FabricInfo(fi_dupinfo(cur));
+        try {
+            if (cur->ep_attr->max_msg_size < opts.msg_size * 2)
+                throw FabricError(-FI_EINVAL);
+            LoopbackPair pair(cur, opts.timeout_ms);
+            result.latency_us = pingpong_latency_us(pair, opts.caps, opts.msg_size, opts.iterations, opts.timeout_ms);
+        } catch (const FabricError &e) {
+            result.error = e.code();
+        }
+        results.push_back(std::move(result));
+    }
+    return results;
+}
+
+/// Lowest latency candidate that passed, nullptr if none did
+inline const ProbeResult *fastest(const std::vector<ProbeResult> &results) {
+    const ProbeResult *best = nullptr;
+    for (auto &r : results) {
+        if (!r.error && (!best || r.latency_us < best->latency_us))
+            best = &r;
+    }
+    return best;
+}
+
+/**
+ * Cache format is one key=value per line. It is only reused if caps, endpoint type and message size match what is
+ * being asked for now.
+ */
+inline bool save_probe_cache(const std::string &path, const ProbeOptions &opts, const ProbeResult &best) {
+    std::ofstream out(path);
+    if (!out)
+        return false;
+    out << "caps=" << opts.caps << "\n"
+        << "ep_type=" << opts.ep_type << "\n"
+        << "msg_size=" << opts.msg_size << "\n"
+        << "provider=" << best.info->fabric_attr->prov_name << "\n"
+        << "fabric=" << best.info->fabric_attr->name << "\n"
+        << "domain=" << best.info->domain_attr->name << "\n"
+        << "selected_ep_type=" << best.info->ep_attr->type << "\n"
+        << "latency_us=" << best.latency_us << "\n";
+    return static_cast<bool>(out);
+}
+
+/// Returns the cached choice, or an empty FabricInfo if there is no usable cache
+inline FabricInfo load_probe_cache(const std::string &path, const ProbeOptions &opts) {
+    std::ifstream in(path);
+    std::map<std::string, std::string> kv;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto eq = line.find('=');
+        if (eq != std::string::npos)
+            kv[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+
+    if (kv["caps"] != std::to_string(opts.caps) || kv["ep_type"] != std::to_string(opts.ep_type) ||
+        kv["msg_size"] != std::to_string(opts.msg_size) || kv["provider"].empty() || kv["selected_ep_type"].empty())
+        return FabricInfo(nullptr);
+
+    const std::string &type = kv["selected_ep_type"];
+    int ep_type = 0;
+    auto [end, ec] = std::from_chars(type.data(), type.data() + type.size(), ep_type);
+    if (ec != std::errc() || end != type.data() + type.size())
+        return FabricInfo(nullptr);
+
+    FabricInfo hints = probe_hints(opts);
+    hints->ep_attr->type = static_cast<fi_ep_type>(ep_type);
+    hints->fabric_attr->prov_name = strdup(kv["provider"].c_str());
+    hints->fabric_attr->name = strdup(kv["fabric"].c_str());
+    hints->domain_attr->name = strdup(kv["domain"].c_str());
+
+    fi_info *list = nullptr;
+    if (fi_getinfo(FIVersion, nullptr, nullptr, 0, hints.get(), &list))
+        return FabricInfo(nullptr);
+    FabricInfo owner(list);
+    return owner.dup();
+}
+
+/**
+ * Start-up entry point: use the cached provider if cache_path has one for these options, otherwise probe, cache
+ * the fastest candidate and return it. Throws FabricError(-FI_ENODATA) if nothing works.
+ */
+inline FabricInfo select_provider(const ProbeOptions &opts, const std::string &cache_path) {
+    FabricInfo cached = load_probe_cache(cache_path, opts);
+    if (cached)
+        return cached;
+
+    std::vector<ProbeResult> results = probe_providers(opts);
+    const ProbeResult *best = fastest(results);
+    if (!best)
+        throw FabricError(-FI_ENODATA, __FILE__, __LINE__);
+
+    save_probe_cache(cache_path, opts, *best);
+    return best->info.dup();
+}
+
+#endif //NETWORKLAYER_PROBE_HH
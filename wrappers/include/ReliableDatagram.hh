@@ -0,0 +1,743 @@
+//
+// Reliable, ordered messages over FI_EP_DGRAM without connections or provider side reliability. Every peer only costs
+// a sequence number pair and, once traffic flows, a window of packet buffers in each direction.
+//
+// Messages are cut into MTU sized fragments, one fragment per packet. Every packet carries a sequence number plus the
+// sender's view of the other direction: the next sequence number it expects (cumulative ACK) and a 64 bit selective
+// ACK bitmap of what it already holds past that. A sender keeps at most `window` packets unacknowledged per peer.
+// Lost packets are resent when their retransmit timer fires on a timer wheel (RTO from smoothed RTT, doubled per
+// resend) or straight away once three later packets have been selectively ACKed.
+//
+// The protocol is templated on the link, so it can be driven without a provider: a link has an Address type, mtu(),
+// now_ns(), transmit(addr, packet, len) and poll(fn(src, packet, len)). DgramLink is the libfabric one.
+//
+// Not thread safe, drive each instance from one thread.
+//
+
+#include <Fabric.hh>
+
+#include <rdma/fi_eq.h>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef NETWORKLAYER_RELIABLEDATAGRAM_HH
+#define NETWORKLAYER_RELIABLEDATAGRAM_HH
+
+/// Starts every packet, followed by len bytes of payload
+struct DgramHeader {
+    static constexpr uint16_t data = 1;
+
+    /// Sequence number of this fragment, meaningless without the data flag
+    uint32_t seq;
+    /// Next sequence number the sender expects from the receiver of this packet
+    uint32_t ack;
+    /// Bit i set: the sender already holds ack + 1 + i
+    uint64_t sack;
+    uint16_t flags;
+    uint16_t len;
+    /// This fragment's index and the number of fragments in its message
+    uint16_t frag;
+    uint16_t frags;
+};
+
+/**
+ * Hashed timer wheel: one bucket per tick, a timer further out than the wheel goes round it and is skipped until its
+ * tick comes up. Timers cannot be cancelled, whoever handles them checks whether they still matter.
+ */
+template<typename T>
+class TimerWheel {
+public:
+    TimerWheel(size_t slots, uint64_t tick_ns) : buckets(slots), tick_ns(tick_ns) {}
+
+    void schedule(uint64_t deadline_ns, T item) {
+        uint64_t tick = std::max((deadline_ns + tick_ns - 1) / tick_ns, current + 1);
+        buckets[tick % buckets.size()].push_back({tick, std::move(item)});
+        pending++;
+    }
+
+    /// Calls fn(item) for every timer due by now_ns. fn may schedule new timers.
+    template<typename Fn>
+    void advance(uint64_t now_ns, Fn &&fn) {
+        uint64_t target = now_ns / tick_ns;
+        if (target <= current)
+            return;
+        if (target - current >= buckets.size()) {
+            current = target;
+            for (size_t i = 0; i < buckets.size(); i++) {
+                fire(i, fn);
+            }
+            return;
+        }
+        while (current < target) {
+            current++;
+            fire(current % buckets.size(), fn);
+        }
+    }
+
+    size_t size() const {
+        return pending;
+    }
+
+private:
+    struct Timer {
+        uint64_t tick;
+        T item;
+    };
+
+    template<typename Fn>
+    void fire(size_t bucket, Fn &&fn) {
+        if (buckets[bucket].empty())
+            return;
+        std::vector<Timer> due;
+        due.swap(buckets[bucket]);
+        for (auto &timer : due) {
+            if (timer.tick <= current) {
+                pending--;
+                fn(timer.item);
+            } else {
+                buckets[bucket].push_back(std::move(timer));
+            }
+        }
+    }
+
+    std::vector<std::vector<Timer>> buckets;
+    uint64_t tick_ns;
+    uint64_t current = 0;
+    size_t pending = 0;
+};
+
+/// Drops a fixed fraction of packets. Seeded, so a run with the same traffic loses the same packets.
+class LossInjector {
+public:
+    LossInjector(double loss, uint64_t seed) : state(seed ? seed : 1) {
+        if (loss >= 1)
+            threshold = UINT64_MAX;
+        else if (loss > 0)
+            threshold = static_cast<uint64_t>(loss * 18446744073709551616.0);
+    }
+
+    bool drop() {
+        if (!threshold)
+            return false;
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL < threshold;
+    }
+
+private:
+    uint64_t state;
+    uint64_t threshold = 0;
+};
+
+struct ReliableOptions {
+    /// Unacknowledged packets per peer, at most 64 so the selective ACK bitmap covers the whole window
+    uint32_t window = 64;
+    /// Retransmit timeout before there is an RTT sample, and the bounds the estimate is kept in
+    uint64_t initial_rto_ns = 1000000;
+    uint64_t min_rto_ns = 200000;
+    uint64_t max_rto_ns = 100000000;
+    /// Resends of one packet before its peer is given up on
+    uint32_t max_retransmits = 30;
+    uint64_t tick_ns = 50000;
+    size_t wheel_slots = 1024;
+    /// Bytes queued per peer behind a full window before send() gives -FI_EAGAIN
+    size_t max_queued = 4 << 20;
+    /// Fraction of outgoing packets, data and ACKs alike, to drop on purpose. 0.05 loses 5%.
+    double loss = 0;
+    uint64_t loss_seed = 1;
+};
+
+struct ReliableStats {
+    /// Packets handed to the link, including the deliberately dropped ones
+    uint64_t packets = 0;
+    uint64_t retransmits = 0;
+    uint64_t fast_retransmits = 0;
+    uint64_t acks = 0;
+    uint64_t duplicates = 0;
+    uint64_t dropped = 0;
+};
+
+template<typename Link>
+class BasicReliableDatagram {
+public:
+    using Address = typename Link::Address;
+
+    /// The link is built in place from link_args, links own posted buffers and do not move
+    template<typename... LinkArgs>
+    explicit BasicReliableDatagram(ReliableOptions opts, LinkArgs &&...link_args)
+            : link(std::forward<LinkArgs>(link_args)...), opts(opts), mtu(link.mtu()),
+              wheel(opts.wheel_slots, opts.tick_ns), loss(opts.loss, opts.loss_seed) {
+        if (!opts.window || opts.window > 64 || mtu <= sizeof(DgramHeader) || !opts.tick_ns || !opts.wheel_slots)
+            throw FabricError(-FI_EINVAL, __FILE__, __LINE__);
+    }
+
+    BasicReliableDatagram(const BasicReliableDatagram &) = delete;
+
+    BasicReliableDatagram &operator=(const BasicReliableDatagram &) = delete;
+
+    /// Index for addr, adding it as a peer if it is new. Packets from addresses that are not peers are dropped.
+    size_t add_peer(Address addr) {
+        auto [it, inserted] = index.emplace(addr, peers.size());
+        if (inserted)
+            peers.emplace_back(addr, opts.initial_rto_ns);
+        return it->second;
+    }
+
+    /// Largest message send() takes
+    size_t max_message() const {
+        return payload_size() * UINT16_MAX;
+    }
+
+    /**
+     * Queues len bytes for peer and sends as much as the window allows. -FI_EAGAIN if too much is queued for this
+     * peer already, -FI_ETIMEDOUT if the peer stopped answering, -FI_EINVAL if peer was never added.
+     */
+    FabricResult<void> send(size_t peer, const void *data, size_t len) {
+        if (peer >= peers.size()) [[unlikely]]
+            return FabricResult<void>::error(-FI_EINVAL);
+        Peer &p = peers[peer];
+        if (p.failed) [[unlikely]]
+            return FabricResult<void>::error(-FI_ETIMEDOUT);
+        if (len > max_message()) [[unlikely]]
+            return FabricResult<void>::error(-FI_EINVAL);
+        if (p.queued_bytes && p.queued_bytes + len > opts.max_queued)
+            return FabricResult<void>::error(-FI_EAGAIN);
+
+        const char *bytes = static_cast<const char *>(data);
+        uint16_t frags = static_cast<uint16_t>(std::max<size_t>((len + payload_size() - 1) / payload_size(), 1));
+        p.queue.push_back({std::vector<char>(bytes, bytes + len), 0, frags});
+        p.queued_bytes += len;
+        now = link.now_ns();
+        fill(peer);
+        return {};
+    }
+
+    /**
+     * Takes in whatever arrived, resends what timed out and sends pending ACKs. Calls deliver(peer, data, len) for
+     * each message completed in order; data is only valid during the call. Gives -FI_ETIMEDOUT once for each peer
+     * that used up its retransmits.
+     */
+    template<typename Fn>
+    FabricResult<void> progress(Fn &&deliver) {
+        now = link.now_ns();
+        auto polled = link.poll([&](Address src, const char *packet, size_t len) {
+            on_packet(src, packet, len, deliver);
+        });
+        if (!polled) [[unlikely]]
+            return FabricResult<void>::error(polled.error());
+
+        wheel.advance(now, [this](const Timeout &t) { on_timeout(t); });
+
+        for (size_t i : ack_due) {
+            if (peers[i].ack_pending)
+                send_ack(i);
+        }
+        ack_due.clear();
+
+        if (newly_failed) [[unlikely]] {
+            newly_failed = false;
+            return FabricResult<void>::error(-FI_ETIMEDOUT);
+        }
+        return {};
+    }
+
+    /// Nothing queued or waiting for an ACK towards peer
+    bool idle(size_t peer) const {
+        const Peer &p = peers[peer];
+        return p.queue.empty() && p.base == p.next_seq;
+    }
+
+    bool failed(size_t peer) const {
+        return peers[peer].failed;
+    }
+
+    const ReliableStats &stats() const {
+        return counters;
+    }
+
+    Link &get_link() {
+        return link;
+    }
+
+private:
+    struct Message {
+        std::vector<char> data;
+        size_t offset;
+        uint16_t frags;
+    };
+
+    struct TxSlot {
+        uint32_t len = 0;
+        uint32_t sends = 0;
+        uint64_t sent_ns = 0;
+        bool acked = false;
+        bool fast = false;
+    };
+
+    struct RxSlot {
+        bool present = false;
+        uint16_t len = 0;
+        uint16_t frag = 0;
+        uint16_t frags = 0;
+    };
+
+    struct Peer {
+        Peer(Address addr, uint64_t rto_ns) : addr(addr), rto_ns(rto_ns) {}
+
+        Address addr;
+        // Send side: base is the oldest unacknowledged sequence number, next_seq the next one to hand out
+        uint32_t base = 0;
+        uint32_t next_seq = 0;
+        /// Packets of the window, allocated on first send
+        std::vector<TxSlot> tx;
+        std::vector<char> tx_buf;
+        std::deque<Message> queue;
+        size_t queued_bytes = 0;
+        uint16_t next_frag_out = 0;
+        uint64_t srtt_ns = 0;
+        uint64_t rttvar_ns = 0;
+        uint64_t rto_ns;
+        bool failed = false;
+        // Receive side: expected is the next sequence number to deliver
+        uint32_t expected = 0;
+        std::vector<RxSlot> rx;
+        std::vector<char> rx_buf;
+        std::vector<char> message;
+        uint16_t next_frag_in = 0;
+        bool ack_pending = false;
+    };
+
+    struct Timeout {
+        size_t peer;
+        uint32_t seq;
+        uint32_t sends;
+    };
+
+    size_t payload_size() const {
+        return mtu - sizeof(DgramHeader);
+    }
+
+    char *tx_packet(Peer &p, uint32_t seq) {
+        return p.tx_buf.data() + (seq % opts.window) * mtu;
+    }
+
+    char *rx_payload(Peer &p, uint32_t seq) {
+        return p.rx_buf.data() + (seq % opts.window) * payload_size();
+    }
+
+    /// Moves queued fragments into the window while it has room
+    void fill(size_t peer) {
+        Peer &p = peers[peer];
+        if (p.tx.empty() && !p.queue.empty()) {
+            p.tx.resize(opts.window);
+            p.tx_buf.resize(size_t(opts.window) * mtu);
+        }
+        while (!p.queue.empty() && p.next_seq - p.base < opts.window && !p.failed) {
+            Message &m = p.queue.front();
+            size_t len = std::min(payload_size(), m.data.size() - m.offset);
+            uint32_t seq = p.next_seq++;
+
+            DgramHeader header = {};
+            header.seq = seq;
+            header.flags = DgramHeader::data;
+            header.len = static_cast<uint16_t>(len);
+            header.frag = p.next_frag_out;
+            header.frags = m.frags;
+            char *packet = tx_packet(p, seq);
+            memcpy(packet, &header, sizeof(header));
+            if (len)
+                memcpy(packet + sizeof(header), m.data.data() + m.offset, len);
+            p.tx[seq % opts.window] = TxSlot{static_cast<uint32_t>(sizeof(header) + len), 0, 0, false, false};
+            transmit_data(peer, seq);
+
+            m.offset += len;
+            if (++p.next_frag_out == m.frags) {
+                p.queued_bytes -= m.data.size();
+                p.next_frag_out = 0;
+                p.queue.pop_front();
+            }
+        }
+    }
+
+    /// (Re)sends seq with the current ACK state piggybacked and arms its retransmit timer
+    void transmit_data(size_t peer, uint32_t seq) {
+        Peer &p = peers[peer];
+        TxSlot &slot = p.tx[seq % opts.window];
+        char *packet = tx_packet(p, seq);
+        DgramHeader header;
+        memcpy(&header, packet, sizeof(header));
+        header.ack = p.expected;
+        header.sack = sack_bits(p);
+        memcpy(packet, &header, sizeof(header));
+        p.ack_pending = false;
+
+        slot.sends++;
+        slot.sent_ns = now;
+        emit(p.addr, packet, slot.len);
+        uint64_t rto = std::min(p.rto_ns << std::min<uint32_t>(slot.sends - 1, 16), opts.max_rto_ns);
+        wheel.schedule(now + rto, Timeout{peer, seq, slot.sends});
+    }
+
+    void send_ack(size_t peer) {
+        Peer &p = peers[peer];
+        DgramHeader header = {};
+        header.seq = p.next_seq;
+        header.ack = p.expected;
+        header.sack = sack_bits(p);
+        p.ack_pending = false;
+        counters.acks++;
+        emit(p.addr, &header, sizeof(header));
+    }
+
+    /// A packet that cannot go out now is as good as lost, the retransmit timer covers both
+    void emit(Address addr, const void *packet, size_t len) {
+        counters.packets++;
+        if (loss.drop()) {
+            counters.dropped++;
+            return;
+        }
+        (void) link.transmit(addr, packet, len);
+    }
+
+    uint64_t sack_bits(Peer &p) const {
+        uint64_t sack = 0;
+        if (p.rx.empty())
+            return sack;
+        for (uint32_t k = 1; k < opts.window; k++) {
+            if (p.rx[(p.expected + k) % opts.window].present)
+                sack |= uint64_t(1) << (k - 1);
+        }
+        return sack;
+    }
+
+    void request_ack(size_t peer) {
+        if (!peers[peer].ack_pending) {
+            peers[peer].ack_pending = true;
+            ack_due.push_back(peer);
+        }
+    }
+
+    template<typename Fn>
+    void on_packet(Address src, const char *packet, size_t len, Fn &&deliver) {
+        DgramHeader header;
+        if (len < sizeof(header)) [[unlikely]]
+            return;
+        memcpy(&header, packet, sizeof(header));
+        if (sizeof(header) + header.len > len || header.len > payload_size()) [[unlikely]]
+            return;
+        auto it = index.find(src);
+        if (it == index.end()) [[unlikely]]
+            return;
+
+        size_t peer = it->second;
+        on_ack(peer, header.ack, header.sack);
+        if (header.flags & DgramHeader::data)
+            on_data(peer, header, packet + sizeof(header), deliver);
+    }
+
+    void on_ack(size_t peer, uint32_t ack, uint64_t sack) {
+        Peer &p = peers[peer];
+        uint32_t in_flight = p.next_seq - p.base;
+        uint32_t cumulative = ack - p.base;
+        if (static_cast<int32_t>(cumulative) < 0)
+            cumulative = 0; // older than what we have already, the bitmap may still say something new
+        else if (cumulative > in_flight) [[unlikely]]
+            return; // ACKs something never sent
+
+        for (uint32_t i = 0; i < cumulative; i++) {
+            acked(p, p.base + i);
+        }
+        for (uint64_t bits = sack; bits; bits &= bits - 1) {
+            uint32_t seq = ack + 1 + std::countr_zero(bits);
+            if (seq - p.base < in_flight)
+                acked(p, seq);
+        }
+        while (p.base != p.next_seq && p.tx[p.base % opts.window].acked) {
+            p.base++;
+        }
+
+        // The peer is still missing base but holds three packets past it: resend now instead of at the timeout
+        if (ack == p.base && p.base != p.next_seq && std::popcount(sack) >= 3) {
+            TxSlot &hole = p.tx[p.base % opts.window];
+            if (!hole.fast) {
+                hole.fast = true;
+                counters.fast_retransmits++;
+                transmit_data(peer, p.base);
+            }
+        }
+        fill(peer);
+    }
+
+    void acked(Peer &p, uint32_t seq) {
+        TxSlot &slot = p.tx[seq % opts.window];
+        if (slot.acked)
+            return;
+        slot.acked = true;
+        // Karn: only packets sent once give an unambiguous RTT
+        if (slot.sends == 1)
+            rtt_sample(p, now - slot.sent_ns);
+    }
+
+    void rtt_sample(Peer &p, uint64_t rtt) {
+        rtt = std::max<uint64_t>(rtt, 1);
+        if (!p.srtt_ns) {
+            p.srtt_ns = rtt;
+            p.rttvar_ns = rtt / 2;
+        } else {
+            uint64_t err = p.srtt_ns > rtt ? p.srtt_ns - rtt : rtt - p.srtt_ns;
+            p.rttvar_ns = (3 * p.rttvar_ns + err) / 4;
+            p.srtt_ns = (7 * p.srtt_ns + rtt) / 8;
+        }
+        p.rto_ns = std::clamp(p.srtt_ns + 4 * p.rttvar_ns, opts.min_rto_ns, opts.max_rto_ns);
+    }
+
+    template<typename Fn>
+    void on_data(size_t peer, const DgramHeader &header, const char *payload, Fn &&deliver) {
+        Peer &p = peers[peer];
+        request_ack(peer);
+        uint32_t offset = header.seq - p.expected;
+        if (offset >= opts.window) {
+            // Behind the window it is a resend whose ACK got lost, ahead of it the sender is broken
+            counters.duplicates++;
+            return;
+        }
+        if (p.rx.empty()) {
+            p.rx.resize(opts.window);
+            p.rx_buf.resize(size_t(opts.window) * payload_size());
+        }
+        RxSlot &slot = p.rx[header.seq % opts.window];
+        if (slot.present) {
+            counters.duplicates++;
+            return;
+        }
+        slot = RxSlot{true, header.len, header.frag, header.frags};
+        memcpy(rx_payload(p, header.seq), payload, header.len);
+
+        while (peers[peer].rx[peers[peer].expected % opts.window].present) {
+            consume(peer, deliver);
+        }
+    }
+
+    /// Hands the fragment at expected to reassembly and moves on
+    template<typename Fn>
+    void consume(size_t peer, Fn &&deliver) {
+        Peer &p = peers[peer];
+        uint32_t seq = p.expected++;
+        RxSlot slot = p.rx[seq % opts.window];
+        p.rx[seq % opts.window].present = false;
+        const char *payload = rx_payload(p, seq);
+
+        if (slot.frag != p.next_frag_in) [[unlikely]] {
+            // Only a confused sender gets here, drop the partial message and resync on the next first fragment
+            p.message.clear();
+            p.next_frag_in = 0;
+            return;
+        }
+        if (slot.frags == 1) [[likely]] {
+            deliver(peer, payload, size_t(slot.len));
+            return;
+        }
+        if (slot.frag == 0)
+            p.message.clear();
+        p.message.insert(p.message.end(), payload, payload + slot.len);
+        if (++p.next_frag_in == slot.frags) {
+            p.next_frag_in = 0;
+            deliver(peer, static_cast<const char *>(peers[peer].message.data()), peers[peer].message.size());
+        }
+    }
+
+    void on_timeout(const Timeout &t) {
+        Peer &p = peers[t.peer];
+        if (p.failed || t.seq - p.base >= p.next_seq - p.base)
+            return;
+        TxSlot &slot = p.tx[t.seq % opts.window];
+        if (slot.acked || slot.sends != t.sends)
+            return;
+        if (slot.sends > opts.max_retransmits) [[unlikely]] {
+            p.failed = true;
+            p.queue.clear();
+            p.queued_bytes = 0;
+            newly_failed = true;
+            return;
+        }
+        counters.retransmits++;
+        transmit_data(t.peer, t.seq);
+    }
+
+    Link link;
+    ReliableOptions opts;
+    size_t mtu;
+    TimerWheel<Timeout> wheel;
+    LossInjector loss;
+    std::vector<Peer> peers;
+    std::unordered_map<Address, size_t> index;
+    std::vector<size_t> ack_due;
+    ReliableStats counters;
+    uint64_t now = 0;
+    bool newly_failed = false;
+};
+
+/**
+ * Packets over a DGRAM endpoint. The endpoint needs FI_SOURCE so a packet can be traced to its sender, and cq has to be
+ * bound to it for both directions (FI_CQ_FORMAT_CONTEXT is enough, the header says how long a packet is) and see
+ * nothing else. Packets up to the provider's inject size are injected, the rest go from registered buffers.
+ * The destructor cancels the posted receives and waits for them and any sends, so the endpoint may outlive the link.
+ */
+class DgramLink {
+public:
+    using Address = fi_addr_t;
+
+    /// mtu is the largest packet, capped at the provider's max_msg_size. 1472 fits an Ethernet frame over UDP/IPv4.
+    DgramLink(DomainView domain, EndpointView ep, InfoView info, CompletionQueue &cq, size_t mtu = 1472,
+              size_t rx_depth = 256, size_t tx_depth = 256)
+            : ep(ep), cq(cq), packet_size(std::min(mtu, info->ep_attr->max_msg_size)),
+              inject_size(info->tx_attr->inject_size), tx_depth(tx_depth), buffers(rx_depth + tx_depth),
+              pool(new char[buffers.size() * packet_size]) {
+        mr = MemoryRegion(domain, pool.get(), buffers.size() * packet_size, FI_SEND | FI_RECV, 0, 0, 0);
+        desc = mr.desc();
+        for (size_t i = 0; i < buffers.size(); i++) {
+            buffers[i].data = pool.get() + i * packet_size;
+            buffers[i].rx = i < rx_depth;
+            if (buffers[i].rx) {
+                post_recv(buffers[i]).value();
+            } else {
+                free_tx.push_back(&buffers[i]);
+            }
+        }
+    }
+
+    DgramLink(const DgramLink &) = delete;
+
+    DgramLink &operator=(const DgramLink &) = delete;
+
+    ~DgramLink() {
+        closing = true;
+        for (auto &buffer : buffers) {
+            if (buffer.rx)
+                (void) fi_cancel(&ep->fid, &buffer.ctx);
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (in_flight() && std::chrono::steady_clock::now() < deadline) {
+            if (!poll([](fi_addr_t, const char *, size_t) {}))
+                break;
+        }
+        // Better to leak the buffers than to free memory the provider may still write to
+        if (in_flight()) [[unlikely]] {
+            std::cerr << "DgramLink: " << in_flight() << " operations did not complete, leaking their buffers"
+                      << std::endl;
+            (void) mr.release();
+            (void) pool.release();
+        }
+    }
+
+    size_t mtu() const {
+        return packet_size;
+    }
+
+    uint64_t now_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// -FI_EAGAIN if every send buffer is in flight; poll() gives them back
+    FabricResult<void> transmit(fi_addr_t dest, const void *packet, size_t len) {
+        if (len <= inject_size)
+            return fabric_status(fi_inject(ep.get(), packet, len, dest));
+        if (free_tx.empty()) [[unlikely]]
+            return FabricResult<void>::error(-FI_EAGAIN);
+        Buffer *buffer = free_tx.back();
+        memcpy(buffer->data, packet, len);
+        auto sent = fabric_status(fi_send(ep.get(), buffer->data, len, desc, dest, &buffer->ctx));
+        if (sent) [[likely]]
+            free_tx.pop_back();
+        return sent;
+    }
+
+    /**
+     * Calls fn(src, packet, len) for each packet that arrived, where len is the buffer size and the header has the real
+     * length. Failed sends and receives count as lost packets, only a broken CQ is an error.
+     */
+    template<typename Fn>
+    FabricResult<size_t> poll(Fn &&fn) {
+        size_t received = 0;
+        int failed = 0;
+        auto reaped = cq.reap_from([&](void *op_context, fi_addr_t src, int err) {
+            if (!op_context)
+                return;
+            auto *buffer = completion_owner<Buffer>(op_context);
+            if (buffer->rx && !err) {
+                fn(src, static_cast<const char *>(buffer->data), packet_size);
+                received++;
+            }
+            auto recycled = recycle(buffer);
+            if (!recycled && !failed) [[unlikely]]
+                failed = recycled.error();
+        });
+        if (!reaped) [[unlikely]]
+            return FabricResult<size_t>::error(reaped.error());
+        if (failed) [[unlikely]]
+            return FabricResult<size_t>::error(failed);
+        return received;
+    }
+
+private:
+    struct Buffer {
+        fi_context ctx;
+        char *data;
+        bool rx;
+    };
+
+    FabricResult<void> post_recv(Buffer &buffer) {
+        auto posted = fabric_retry(cq.get(), [&]() {
+            return fi_recv(ep.get(), buffer.data, packet_size, desc, FI_ADDR_UNSPEC, &buffer.ctx);
+        });
+        if (posted) [[likely]]
+            rx_posted++;
+        return posted;
+    }
+
+    /// Reposts a receive that came back, unless the link is going away, or returns a send buffer to the pool
+    FabricResult<void> recycle(Buffer *buffer) {
+        if (!buffer->rx) {
+            free_tx.push_back(buffer);
+            return {};
+        }
+        rx_posted--;
+        if (closing)
+            return {};
+        return post_recv(*buffer);
+    }
+
+    /// Receives posted plus send buffers in flight
+    size_t in_flight() const {
+        return rx_posted + tx_depth - free_tx.size();
+    }
+
+    EndpointView ep;
+    CompletionQueue &cq;
+    size_t packet_size;
+    size_t inject_size;
+    size_t tx_depth;
+    std::vector<Buffer> buffers;
+    std::unique_ptr<char[]> pool;
+    MemoryRegion mr;
+    void *desc = nullptr;
+    std::vector<Buffer *> free_tx;
+    size_t rx_posted = 0;
+    bool closing = false;
+};
+
+using ReliableDatagram = BasicReliableDatagram<DgramLink>;
+
+#endif //NETWORKLAYER_RELIABLEDATAGRAM_HH
@@ -0,0 +1,341 @@
+//
+// One-sided SPSC ring channel. The consumer owns a registered ring of fixed size slots plus a head word. The producer
+// fi_writes records straight into the consumer's slots and then writes the new head. The consumer finds records by
+// polling its head word and hands credits back by writing its tail into the producer's credit word. Nothing is ever
+// posted on the receive side.
+//
+// Head and tail are monotonically increasing record counts, slot i lives at i % slots. A record is a uint32_t length
+// followed by the payload, one record per slot.
+//
+// The head write must not overtake the record writes. If the provider orders write-after-write (FI_ORDER_WAW in
+// tx_attr->msg_order) for writes of this size (up to ep_attr->max_order_waw_size) the head goes out right behind the
+// records, otherwise the producer asks for delivery complete on the record writes and waits for them before writing
+// the head. Once a record write fails the producer stops moving the head and every call returns that error.
+//
+
+#include <Fabric.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#ifndef NETWORKLAYER_RINGCHANNEL_HH
+#define NETWORKLAYER_RINGCHANNEL_HH
+
+/// What one side needs to know about the other side's registered block. Send it over however you bootstrap.
+struct RingDescriptor {
+    /// Base of the block as the remote MR expects it: its virtual address with FI_MR_VIRT_ADDR, 0 otherwise
+    uint64_t addr;
+    uint64_t key;
+    uint32_t slots;
+    uint32_t slot_size;
+};
+
+/**
+ * Registered block shared by both ends: a 64 byte control word (head at the consumer, credit tail at the producer)
+ * followed by the slots.
+ */
+class RingBlock {
+public:
+    static constexpr size_t control_size = 64;
+
+    RingDescriptor descriptor() const {
+        return {virt_addr ? reinterpret_cast<uint64_t>(block.data()) : 0, mr.key(), slots, slot_size};
+    }
+
+    /// Largest payload a record can carry
+    uint32_t max_record() const {
+        return slot_size - sizeof(uint32_t);
+    }
+
+protected:
+    RingBlock(DomainView domain, InfoView info, uint32_t slots, uint32_t slot_size, uint64_t access,
+              uint64_t requested_key) : slots(slots), slot_size(slot_size), mask(slots - 1),
+                                        block(control_size + size_t(slots) * slot_size) {
+        if (!slots || (slots & mask) || slot_size < 2 * sizeof(uint32_t) || (slot_size & (slot_size - 1)))
+            throw FabricError(-FI_EINVAL, __FILE__, __LINE__);
+        virt_addr = info->domain_attr->mr_mode == FI_MR_BASIC || (info->domain_attr->mr_mode & FI_MR_VIRT_ADDR);
+        mr = MemoryRegion(domain, block.data(), block.size(), access, 0, requested_key, 0);
+    }
+
+    /// The word the peer writes into
+    std::atomic_ref<uint64_t> control() {
+        return std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t *>(block.data()));
+    }
+
+    char *slot(uint64_t i) {
+        return block.data() + control_size + (i & mask) * slot_size;
+    }
+
+    void check_peer(const RingDescriptor &peer) const {
+        if (peer.slots != slots || peer.slot_size != slot_size)
+            throw FabricError(-FI_EINVAL, __FILE__, __LINE__);
+    }
+
+    uint32_t slots;
+    uint32_t slot_size;
+    uint64_t mask;
+    std::vector<char> block;
+    MemoryRegion mr;
+    bool virt_addr;
+};
+
+class RingProducer : public RingBlock {
+public:
+    /**
+     * tx_cq is where ep reports transmit completions and must only see this producer's writes. Records are written
+     * out once flush_batch of them are staged, or on flush().
+     */
+    RingProducer(DomainView domain, EndpointView ep, InfoView info, CompletionQueue &tx_cq, uint32_t slots,
+                 uint32_t slot_size, uint64_t requested_key = 0, uint32_t flush_batch = 16)
+            : RingBlock(domain, info, slots, slot_size, FI_WRITE | FI_REMOTE_WRITE, requested_key), ep(ep),
+              tx_cq(tx_cq), flush_batch(flush_batch) {
+        if (info->tx_attr->msg_order & FI_ORDER_WAW)
+            max_ordered = info->ep_attr->max_order_waw_size;
+        for (auto &c : ctx) {
+            c.busy = false;
+        }
+    }
+
+    void connect(fi_addr_t consumer, const RingDescriptor &remote) {
+        check_peer(remote);
+        peer = consumer;
+        this->remote = remote;
+    }
+
+    /// Stages a record. Gives false if the ring is full; flush() and progress() until the consumer hands slots back.
+    FabricResult<bool> try_push(const void *data, uint32_t len) {
+        if (len > max_record()) [[unlikely]]
+            return FabricResult<bool>::error(-FI_EINVAL);
+        if (staged - control().load(std::memory_order_acquire) >= slots) [[unlikely]]
+            return false;
+
+        char *s = slot(staged);
+        memcpy(s, &len, sizeof(len));
+        memcpy(s + sizeof(len), data, len);
+        staged++;
+        if (staged - flushed >= flush_batch) {
+            auto sent = flush();
+            if (!sent) [[unlikely]]
+                return FabricResult<bool>::error(sent.error());
+        }
+        return true;
+    }
+
+    /// Stages a record, waiting for credits if the ring is full
+    FabricResult<void> push(const void *data, uint32_t len) {
+        while (true) {
+            auto pushed = try_push(data, len);
+            if (!pushed) [[unlikely]]
+                return FabricResult<void>::error(pushed.error());
+            if (*pushed) [[likely]]
+                return {};
+            auto sent = flush();
+            if (!sent) [[unlikely]]
+                return sent;
+            auto reaped = progress();
+            if (!reaped) [[unlikely]]
+                return reaped;
+        }
+    }
+
+    /// Writes every staged record and then the new head. After a failed record write the head is never moved again.
+    FabricResult<void> flush() {
+        if (write_error) [[unlikely]]
+            return FabricResult<void>::error(write_error);
+        if (staged == flushed)
+            return {};
+
+        uint64_t first = flushed & mask;
+        uint64_t count = staged - flushed;
+        uint64_t contiguous = std::min<uint64_t>(count, slots - first);
+        bool unordered = false;
+        auto written = write_slots(first, contiguous, unordered);
+        if (written && contiguous < count)
+            written = write_slots(0, count - contiguous, unordered);
+        if (!written) [[unlikely]]
+            return written;
+
+        while (unordered && outstanding) {
+            auto reaped = progress();
+            if (!reaped) [[unlikely]]
+                return reaped;
+        }
+
+        uint64_t head = staged;
+        auto posted = fabric_retry_with([this]() { return progress(); }, [&]() {
+            return fi_inject_write(ep.get(), &head, sizeof(head), peer, remote.addr, remote.key);
+        });
+        if (posted) [[likely]]
+            flushed = staged;
+        return posted;
+    }
+
+    /// Reaps write completions. Also what drives progress on providers with manual progress.
+    FabricResult<void> progress() {
+        int failed = 0;
+        auto reaped = tx_cq.reap([&](void *op_context, int err) {
+            complete(op_context);
+            if (err && !failed)
+                failed = err;
+        });
+        if (!reaped) [[unlikely]]
+            return FabricResult<void>::error(reaped.error());
+        if (failed) [[unlikely]] {
+            if (!write_error)
+                write_error = failed;
+            return FabricResult<void>::error(failed);
+        }
+        return {};
+    }
+
+    /// Records staged or written that the consumer has not handed back yet
+    uint64_t in_use() {
+        return staged - control().load(std::memory_order_acquire);
+    }
+
+private:
+    static constexpr size_t max_writes = 64;
+
+    struct WriteContext {
+        fi_context ctx;
+        bool busy;
+    };
+
+    /// Sets unordered if the write is too big for the provider's WAW ordering and went out with delivery complete
+    FabricResult<void> write_slots(uint64_t first, uint64_t count, bool &unordered) {
+        WriteContext &wc = ctx[next_ctx];
+        while (wc.busy) {
+            auto reaped = progress();
+            if (!reaped) [[unlikely]]
+                return reaped;
+        }
+
+        uint32_t last_len;
+        memcpy(&last_len, slot(first + count - 1), sizeof(last_len));
+        size_t bytes = (count - 1) * slot_size + sizeof(uint32_t) + last_len;
+        uint64_t offset = control_size + first * slot_size;
+
+        iovec iov = {slot(first), bytes};
+        void *desc = mr.desc();
+        fi_rma_iov rma_iov = {remote.addr + offset, bytes, remote.key};
+        fi_msg_rma msg = {};
+        msg.msg_iov = &iov;
+        msg.desc = &desc;
+        msg.iov_count = 1;
+        msg.addr = peer;
+        msg.rma_iov = &rma_iov;
+        msg.rma_iov_count = 1;
+        msg.context = &wc.ctx;
+        bool ordered = bytes <= max_ordered;
+        uint64_t flags = FI_COMPLETION | (ordered ? 0 : FI_DELIVERY_COMPLETE);
+
+        auto posted = fabric_retry_with([this]() { return progress(); }, [&]() {
+            return fi_writemsg(ep.get(), &msg, flags);
+        });
+        if (posted) [[likely]] {
+            unordered |= !ordered;
+            wc.busy = true;
+            outstanding++;
+            next_ctx = (next_ctx + 1) % max_writes;
+        }
+        return posted;
+    }
+
+    void complete(void *context) {
+        if (!context)
+            return;
+        completion_owner<WriteContext>(context)->busy = false;
+        outstanding--;
+    }
+
+    EndpointView ep;
+    CompletionQueue &tx_cq;
+    /// Largest write the provider keeps in order with the head write behind it, 0 if it does not order writes
+    size_t max_ordered = 0;
+    uint32_t flush_batch;
+    fi_addr_t peer = FI_ADDR_UNSPEC;
+    RingDescriptor remote = {};
+    uint64_t staged = 0;
+    uint64_t flushed = 0;
+    WriteContext ctx[max_writes];
+    size_t next_ctx = 0;
+    size_t outstanding = 0;
+    /// First failed record write; the records behind it never landed
+    int write_error = 0;
+};
+
+class RingConsumer : public RingBlock {
+public:
+    /**
+     * cq is only used to drive progress (providers with manual progress need the target to poll for the producer's
+     * writes to land) and for credit writes that hit -FI_EAGAIN; no completions are taken off it.
+     */
+    RingConsumer(DomainView domain, EndpointView ep, InfoView info, CompletionQueue &cq, uint32_t slots,
+                 uint32_t slot_size, uint64_t requested_key = 0)
+            : RingBlock(domain, info, slots, slot_size, FI_WRITE | FI_REMOTE_WRITE, requested_key), ep(ep), cq(cq),
+              credit_batch(std::max<uint32_t>(slots / 4, 1)) {}
+
+    void connect(fi_addr_t producer, const RingDescriptor &remote) {
+        check_peer(remote);
+        peer = producer;
+        this->remote = remote;
+    }
+
+    /**
+     * Calls fn(data, len) for up to max records that have arrived and returns how many there were. The slot is handed
+     * back to the producer afterwards, so fn has to be done with data when it returns.
+     */
+    template<typename Fn>
+    FabricResult<size_t> poll(Fn &&fn, size_t max = SIZE_MAX) {
+        uint64_t head = control().load(std::memory_order_acquire);
+        if (head == tail) {
+            (void) fi_cq_read(cq.get(), nullptr, 0);
+            if (credited != tail) {
+                auto returned = return_credits();
+                if (!returned) [[unlikely]]
+                    return FabricResult<size_t>::error(returned.error());
+            }
+            return size_t(0);
+        }
+
+        size_t count = 0;
+        while (tail != head && count < max) {
+            const char *s = slot(tail);
+            uint32_t len;
+            memcpy(&len, s, sizeof(len));
+            fn(s + sizeof(len), len);
+            tail++;
+            count++;
+        }
+
+        if (tail - credited >= credit_batch) {
+            auto returned = return_credits();
+            if (!returned) [[unlikely]]
+                return FabricResult<size_t>::error(returned.error());
+        }
+        return count;
+    }
+
+private:
+    FabricResult<void> return_credits() {
+        uint64_t value = tail;
+        auto posted = fabric_retry(cq.get(), [&]() {
+            return fi_inject_write(ep.get(), &value, sizeof(value), peer, remote.addr, remote.key);
+        });
+        if (posted) [[likely]]
+            credited = value;
+        return posted;
+    }
+
+    EndpointView ep;
+    CompletionQueue &cq;
+    uint32_t credit_batch;
+    fi_addr_t peer = FI_ADDR_UNSPEC;
+    RingDescriptor remote = {};
+    uint64_t tail = 0;
+    uint64_t credited = 0;
+};
+
+#endif //NETWORKLAYER_RINGCHANNEL_HH
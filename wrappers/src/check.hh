@@ -0,0 +1,12 @@
+//
+// Assertion shared by the provider-free tests: reports the failed expression and returns 1 from main.
+//
+
+#include <iostream>
+
+#ifndef NETWORKLAYER_CHECK_HH
+#define NETWORKLAYER_CHECK_HH
+
+#define CHECK(x) if (!(x)) { std::cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << std::endl; return 1; }
+
+#endif //NETWORKLAYER_CHECK_HH
@@ -0,0 +1,56 @@
+//
+// Frame format round trip for the coalescing layer, no provider needed.
+//
+
+#include <Coalescer.hh>
+#include "check.hh"
+
+#include <string>
+#include <vector>
+
+int main() {
+    std::vector<char> buf(64);
+    FramePacker packer(buf.data(), buf.size());
+    CHECK(packer.empty());
+
+    std::vector<std::string> sent = {"a", "hello", "", "world!"};
+    for (auto &msg : sent) {
+        CHECK(packer.append(msg.data(), msg.size()));
+    }
+    CHECK(packer.records() == sent.size());
+
+    // Does not fit: 64 bytes minus what is used already
+    std::string big(64, 'x');
+    size_t before = packer.size();
+    CHECK(!packer.append(big.data(), big.size()));
+    CHECK(packer.size() == before);
+
+    // Lengths past the 16 bit record header are refused, not wrapped
+    std::vector<char> huge(70000, 'z');
+    CHECK(!packer.append(huge.data(), huge.size()));
+    CHECK(packer.size() == before);
+
+    std::vector<std::string> received;
+    CHECK(unpack_frame(packer.data(), packer.size(), [&](const char *record, size_t record_len) {
+        FrameHeader header;
+        memcpy(&header, record, sizeof(header));
+        if (record_len == sizeof(header) + header.data_len)
+            received.emplace_back(record + sizeof(header), header.data_len);
+    }));
+    CHECK(received == sent);
+
+    // Truncated frames are rejected
+    CHECK(!unpack_frame(packer.data(), packer.size() - 1, [](const char *, size_t) {}));
+    CHECK(!unpack_frame(packer.data(), 2, [](const char *, size_t) {}));
+
+    // A frame filled to the brim still round trips
+    packer.reset();
+    std::string exact(FramePacker::max_payload(buf.size()), 'y');
+    CHECK(packer.append(exact.data(), exact.size()));
+    CHECK(packer.size() == buf.size());
+    size_t records = 0;
+    CHECK(unpack_frame(packer.data(), packer.size(), [&](const char *, size_t) { records++; }));
+    CHECK(records == 1);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+//
+// Reduction kernels and the broadcast/ring schedules used by the collectives, no provider needed.
+//
+
+#include <Collectives.hh>
+#include "check.hh"
+
+#include <vector>
+
+template<typename T>
+bool sums_match() {
+    // Every length up to a few vectors, starting off any alignment, so both vector loops and the tail are covered
+    for (size_t offset = 0; offset < 3; offset++) {
+        for (size_t count = 0; count < 70; count++) {
+            std::vector<T> dst(offset + count), src(offset + count);
+            for (size_t i = 0; i < dst.size(); i++) {
+                dst[i] = static_cast<T>(i);
+                src[i] = static_cast<T>(3 * i + 1);
+            }
+            reduce_sum(dst.data() + offset, src.data() + offset, count);
+            for (size_t i = 0; i < dst.size(); i++) {
+                T expected = static_cast<T>(i >= offset ? 4 * i + 1 : i);
+                if (dst[i] != expected)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    CHECK(sums_match<float>());
+    CHECK(sums_match<double>());
+    CHECK(sums_match<int32_t>());
+
+    // Broadcast tree: every rank but the root is the child of its parent, exactly once
+    for (int n = 1; n <= 33; n++) {
+        std::vector<int> parent_of(n, -2);
+        for (int v = 0; v < n; v++) {
+            binomial_children(v, n, [&](int child) {
+                if (child > v && child < n && parent_of[child] == -2)
+                    parent_of[child] = v;
+                else
+                    parent_of[child] = -3;
+            });
+        }
+        CHECK(binomial_parent(0) == -1);
+        for (int v = 1; v < n; v++) {
+            CHECK(parent_of[v] == binomial_parent(v));
+        }
+    }
+
+    // Ring chunks tile the vector in order and differ in size by at most one
+    for (int n = 1; n <= 9; n++) {
+        for (size_t count = 0; count < 40; count++) {
+            size_t next = 0;
+            for (int i = 0; i < n; i++) {
+                auto [offset, len] = ring_chunk(count, n, i);
+                CHECK(offset == next);
+                CHECK(len == count / n || len == count / n + 1);
+                next += len;
+            }
+            CHECK(next == count);
+        }
+    }
+
+    return 0;
+}
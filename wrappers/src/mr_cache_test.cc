@@ -0,0 +1,107 @@
+//
+// Lookup, merging, eviction and invalidation of the registration cache against a fake registrar, no provider needed.
+//
+
+#include <MRCache.hh>
+#include "check.hh"
+
+#include <vector>
+
+struct FakeRegion {
+    uintptr_t start = 0;
+    size_t len = 0;
+};
+
+/// Never touches memory, so the addresses below do not have to exist
+struct FakeRegistrar {
+    using Region = FakeRegion;
+
+    Region reg(const void *buf, size_t len) {
+        (*registrations)++;
+        if (fail_over && len > fail_over)
+            throw FabricError(-FI_EINVAL);
+        return {reinterpret_cast<uintptr_t>(buf), len};
+    }
+
+    int *registrations;
+    size_t fail_over = 0;
+};
+
+const void *addr(uintptr_t a) {
+    return reinterpret_cast<const void *>(a);
+}
+
+int main() {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t base = 1000 * page;
+    int registrations = 0;
+
+    {
+        BasicMRCache<FakeRegistrar> cache(FakeRegistrar{&registrations}, 16 * page);
+
+        // Miss registers whole pages, then anything inside is a hit
+        {
+            auto ref = cache.acquire(addr(base + 10), 100);
+            CHECK(ref.region().start == base && ref.region().len == page);
+            auto again = cache.acquire(addr(base + 200), page - 200);
+            CHECK(cache.hits() == 1 && cache.misses() == 1 && registrations == 1);
+        }
+
+        // Adjacent range merges with the existing one
+        {
+            auto ref = cache.acquire(addr(base + page), page);
+            CHECK(ref.region().start == base && ref.region().len == 2 * page);
+            CHECK(cache.size() == 1 && cache.pinned() == 2 * page);
+        }
+
+        // A range bridging two entries merges all three
+        {
+            auto far = cache.acquire(addr(base + 4 * page), page);
+            CHECK(cache.size() == 2);
+            auto bridge = cache.acquire(addr(base + 2 * page), 2 * page);
+            CHECK(bridge.region().start == base && bridge.region().len == 5 * page);
+            CHECK(cache.size() == 1);
+            // far's old registration lives on until far is released
+            CHECK(far.region().len == page && cache.pinned() == 6 * page);
+        }
+        CHECK(cache.pinned() == 5 * page);
+
+        // Invalidate while in use: no longer found, but the Ref keeps it registered
+        {
+            auto ref = cache.acquire(addr(base), page);
+            cache.invalidate(addr(base + 3 * page), 1);
+            CHECK(cache.size() == 0 && cache.pinned() == 5 * page);
+            int before = registrations;
+            auto fresh = cache.acquire(addr(base), page);
+            CHECK(registrations == before + 1 && fresh.region().len == page);
+        }
+        CHECK(cache.pinned() == page);
+        cache.invalidate(addr(base), page);
+        CHECK(cache.pinned() == 0 && cache.size() == 0);
+
+        // Over budget, the least recently released unused ranges go first
+        for (uintptr_t i = 0; i < 20; i++) {
+            cache.acquire(addr(base + 2 * i * page), page);
+        }
+        CHECK(cache.pinned() <= 16 * page);
+        CHECK(cache.evictions() == 4);
+        int before = registrations;
+        cache.acquire(addr(base + 2 * 19 * page), 1);
+        CHECK(registrations == before);
+        cache.acquire(addr(base), 1);
+        CHECK(registrations == before + 1);
+    }
+
+    {
+        // If the merged range cannot be registered, fall back to just the requested pages
+        FakeRegistrar registrar{&registrations, page};
+        BasicMRCache<FakeRegistrar> cache(registrar, 16 * page);
+        auto left = cache.acquire(addr(base), page);
+        auto right = cache.acquire(addr(base + page), page);
+        CHECK(right.region().start == base + page && right.region().len == page);
+        CHECK(cache.size() == 2);
+        CHECK(cache.acquire(addr(base + 10), 1).region().start == base);
+    }
+
+    return 0;
+}
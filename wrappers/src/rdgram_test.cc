@@ -0,0 +1,152 @@
+//
+// Reliable datagram protocol over an in-memory link with a virtual clock, so loss and recovery are deterministic and
+// no provider is needed.
+//
+
+#include <ReliableDatagram.hh>
+#include "check.hh"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+struct Wire {
+    struct Packet {
+        int src;
+        std::vector<char> data;
+    };
+
+    std::deque<Packet> queue[2];
+    uint64_t clock = 0;
+};
+
+/// Side `side` of the wire, addresses are the side numbers
+struct FakeLink {
+    using Address = int;
+
+    Wire *wire;
+    int side;
+
+    size_t mtu() const {
+        return 512;
+    }
+
+    uint64_t now_ns() const {
+        return wire->clock;
+    }
+
+    FabricResult<void> transmit(int dest, const void *packet, size_t len) {
+        const char *p = static_cast<const char *>(packet);
+        wire->queue[dest].push_back({side, std::vector<char>(p, p + len)});
+        return {};
+    }
+
+    template<typename Fn>
+    FabricResult<size_t> poll(Fn &&fn) {
+        size_t n = 0;
+        while (!wire->queue[side].empty()) {
+            Wire::Packet packet = std::move(wire->queue[side].front());
+            wire->queue[side].pop_front();
+            fn(packet.src, packet.data.data(), packet.data.size());
+            n++;
+        }
+        return n;
+    }
+};
+
+std::string message(int i) {
+    // Sizes from empty to several fragments
+    return std::string((i * 397) % 3000, static_cast<char>('a' + i % 26));
+}
+
+/// Sends count messages each way and checks they all arrive intact and in order. Returns false on any mismatch.
+bool exchange(double loss, int count, ReliableStats &stats) {
+    Wire wire;
+    ReliableOptions opts;
+    opts.loss = loss;
+    opts.loss_seed = 7;
+    BasicReliableDatagram<FakeLink> side[2] = {BasicReliableDatagram<FakeLink>(opts, &wire, 0),
+                                               BasicReliableDatagram<FakeLink>(opts, &wire, 1)};
+    size_t peer[2] = {side[0].add_peer(1), side[1].add_peer(0)};
+
+    int sent[2] = {0, 0};
+    std::vector<std::string> received[2];
+    for (int round = 0; round < 1000000; round++) {
+        for (int s = 0; s < 2; s++) {
+            while (sent[s] < count) {
+                std::string m = message(sent[s]);
+                if (!side[s].send(peer[s], m.data(), m.size()))
+                    break;
+                sent[s]++;
+            }
+            auto done = side[s].progress([&](size_t, const char *data, size_t len) {
+                received[s].emplace_back(data, len);
+            });
+            if (!done)
+                return false;
+        }
+        wire.clock += 10000;
+        if (received[0].size() == size_t(count) && received[1].size() == size_t(count) && side[0].idle(peer[0]) &&
+            side[1].idle(peer[1]))
+            break;
+    }
+
+    for (int s = 0; s < 2; s++) {
+        if (received[s].size() != size_t(count))
+            return false;
+        for (int i = 0; i < count; i++) {
+            if (received[s][i] != message(i))
+                return false;
+        }
+    }
+    stats = side[0].stats();
+    return true;
+}
+
+int main() {
+    static_assert(sizeof(DgramHeader) == 24);
+
+    // Timers fire on their tick, including ones further out than one turn of the wheel
+    TimerWheel<int> wheel(8, 10);
+    std::vector<int> fired;
+    wheel.schedule(25, 1);
+    wheel.schedule(200, 2);
+    wheel.schedule(5, 3);
+    wheel.advance(20, [&](int id) { fired.push_back(id); });
+    CHECK(fired == std::vector<int>({3}));
+    wheel.advance(100, [&](int id) { fired.push_back(id); });
+    CHECK(fired == std::vector<int>({3, 1}));
+    CHECK(wheel.size() == 1);
+    wheel.advance(1000, [&](int id) { fired.push_back(id); });
+    CHECK(fired == std::vector<int>({3, 1, 2}));
+    CHECK(wheel.size() == 0);
+
+    // Loss is deterministic for a seed and close to the asked for rate
+    LossInjector a(0.05, 42), b(0.05, 42), none(0, 42);
+    int drops = 0;
+    for (int i = 0; i < 100000; i++) {
+        bool dropped = a.drop();
+        CHECK(dropped == b.drop());
+        CHECK(!none.drop());
+        drops += dropped;
+    }
+    CHECK(drops > 4500 && drops < 5500);
+
+    ReliableStats stats;
+    CHECK(exchange(0, 500, stats));
+    CHECK(stats.retransmits == 0 && stats.fast_retransmits == 0 && stats.dropped == 0);
+
+    for (double loss : {0.01, 0.05, 0.2}) {
+        CHECK(exchange(loss, 500, stats));
+        CHECK(stats.dropped > 0);
+        CHECK(stats.retransmits + stats.fast_retransmits > 0);
+    }
+
+    // Peers that were never added are refused
+    Wire wire;
+    BasicReliableDatagram<FakeLink> lonely(ReliableOptions(), &wire, 0);
+    char byte = 0;
+    auto refused = lonely.send(0, &byte, 1);
+    CHECK(!refused && refused.error() == -FI_EINVAL);
+    return 0;
+}
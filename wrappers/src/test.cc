@@ -7,6 +7,13 @@
 #include <rdma/fi_endpoint.h>
 #include <rdma/fi_rma.h>
 #include <rdma/fi_cm.h>
+#include <type_traits>
+
+// Owners are move-only, views are just pointers
+static_assert(!std::is_copy_constructible_v<ActiveEndpoint>);
+static_assert(std::is_nothrow_move_constructible_v<ActiveEndpoint>);
+static_assert(std::is_trivially_copyable_v<DomainView>);
+static_assert(sizeof(AccessDomain) == sizeof(fid_domain *));
 
 int main(int argc, char **argv) {
 
@@ -53,22 +60,26 @@ int main(int argc, char **argv) {
 
     std::cerr << fi_mr_key(mr.get()) << std::endl;
 
-    fid_pep *pep;
+    fid_pep *raw_pep;
 
-    if (fi_passive_ep(fabric.get(), info.get(), &pep, NULL)) {
+    if (fi_passive_ep(fabric.get(), info.get(), &raw_pep, NULL)) {
         perror("");
     }
 
-    if (fi_pep_bind(pep, &eq->fid, 0)) {
+    Handle<fid_pep> pep(raw_pep);
+
+    if (fi_pep_bind(pep.get(), &eq->fid, 0)) {
         perror("");
     }
 
-    if (fi_listen(pep)) {
+    if (fi_listen(pep.get())) {
         perror("");
     }
 
-    if (fi_close(&pep->fid)) {
-        perror("");
+    Handle<fid_pep> moved(std::move(pep));
+    if (pep || !moved) {
+        std::cerr << "move did not transfer ownership" << std::endl;
+        return 1;
     }
 
     delete[] buf;